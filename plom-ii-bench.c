@@ -0,0 +1,498 @@
+// plom-ii-bench: flood plom-ii from a local fake IRC server, measure it
+//
+// plom-ii-bench is licensed under the GPL v3 or any later version; see file
+// LICENSE or <http://www.gnu.org/licenses/gpl-3.0.html>.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define HOST "127.0.0.1" /* also the name of plom-ii's server directory */
+#define NICK "bench"
+#define PROBE "#probe" /* channel whose out file is read back for latency */
+#define MAX_LINE 512 /* bytes of a server line, "\r\n" included */
+#define SENDBUF 65536 /* bytes of server lines queued for plom-ii at most */
+#define INBUF 65536 /* bytes of plom-ii's output read at once */
+#define SETUP_TIMEOUT 10000 /* ms to wait for plom-ii to log in, join */
+#define END_TIMEOUT 60000 /* ms to wait for the last probe without progress */
+#define DRAIN_TIMEOUT 5000 /* ms to wait for fifo lines after the flood */
+#define MAX_SAMPLES (1 << 22) /* latencies kept per kind at most */
+
+typedef struct Samples Samples;
+struct Samples {   /* latencies in ns, grown on demand */
+  long long *v;
+  size_t n, cap; };
+
+// Load: n_lines server lines of about line_size bytes to n_channels channels
+// at rate lines per second (0: as fast as plom-ii takes them), mixed as mix[]
+// tells; every probe_every-th one to PROBE. Meanwhile fifo_rate lines per
+// second written to the channels' fifos, round robin.
+static char *plom_ii = "./plom-ii";
+static long long n_lines = 200000, rate = 0, fifo_rate = 1000;
+static int n_channels = 50, line_size = 120, probe_every = 100;
+static int mix[4] = { 85, 5, 5, 5 }; /* percent PRIVMSG, JOIN, PART, 353 */
+
+static char dir[] = "/tmp/plom-ii-bench-XXXXXX"; /* plom-ii's irc directory */
+static pid_t pid = 0; /* of plom-ii */
+static int irc = -1; /* connection from plom-ii */
+static char sendbuf[SENDBUF], inbuf[INBUF];
+static size_t send_len, in_len;
+static int logged_in = 0;
+static int *fifos; /* write end of each channel's fifo, -1: to be opened */
+static int in_fd, probe_fd = -1; /* inotify; PROBE's out file, read to end */
+static char probe_part[MAX_LINE * 2];
+static size_t probe_len;
+static long long end_ns = 0; /* when the last probe was read back */
+static long long fifo_sent = 0, fifo_dropped = 0, fifo_echoed = 0;
+static Samples out_lat, fifo_lat; /* server line to out file, fifo to server */
+
+static void usage() {
+// Print help message.
+  fprintf(stderr, "%s",
+          "usage: plom-ii-bench [-n <server lines>] [-c <channels>] [-s <bytes per line>]\n"
+          "          [-r <server lines per s, 0: no limit>] [-f <fifo lines per s>]\n"
+          "          [-m <percent PRIVMSG,JOIN,PART,353>] [-e <lines per probe>]\n"
+          "          [-x <plom-ii binary>] [-- <further plom-ii options>]\n");
+  exit(EXIT_FAILURE); }
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+// nftw() callback: remove path; for an out file, also the shared memory ring
+// plom-ii (run with -m) may have left for it, named by its real path's hash.
+  char real[PATH_MAX], name[32];
+  unsigned long long h = 14695981039346656037ULL;
+  char *p;
+  if(!strcmp(path + ftw->base, "out") && realpath(path, real)) {
+    for(p = real; *p; p++)
+      h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+    snprintf(name, sizeof(name), "/plom-ii-%016llx", h);
+    shm_unlink(name); }
+  remove(path);
+  return 0; }
+
+static void cleanup() {
+// Stop plom-ii, remove its irc directory.
+  if(pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    pid = 0; }
+  if(dir[strlen(dir) - 1] != 'X')
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS); }
+
+static void fail(const char *msg) {
+// Print msg and system error, clean up, exit.
+  perror(msg);
+  exit(EXIT_FAILURE); }
+
+static long long now_ns() {
+// Return monotonic clock in ns.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec; }
+
+static void add_sample(Samples *s, long long ns) {
+// Keep latency ns in s, up to MAX_SAMPLES of them.
+  if(s->n == s->cap) {
+    if(s->cap == MAX_SAMPLES)
+      return;
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    if(!(s->v = realloc(s->v, s->cap * sizeof(long long))))
+      fail("plom-ii-bench: cannot allocate memory"); }
+  s->v[s->n++] = ns; }
+
+static int cmp_ll(const void *a, const void *b) {
+// qsort() callback: order long longs ascending.
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return x < y ? -1 : x > y; }
+
+static void print_latency(const char *what, Samples *s) {
+// Print percentiles of s' latencies in µs.
+  if(!s->n) {
+    printf("  latency %-22s no samples\n", what);
+    return; }
+  qsort(s->v, s->n, sizeof(long long), cmp_ll);
+  printf("  latency %-22s p50 %.0f, p90 %.0f, p99 %.0f, max %.0f us (%zu samples)\n",
+         what, s->v[s->n / 2] / 1e3, s->v[s->n * 9 / 10] / 1e3,
+         s->v[s->n * 99 / 100] / 1e3, s->v[s->n - 1] / 1e3, s->n); }
+
+static void proc_stats(long long *cpu_ns, long long *user_ns, long long *syscr,
+                       long long *syscw) {
+// Read CPU time (all, user) and read / write syscall counts of plom-ii from /proc.
+  char path[64], buf[1024], *p;
+  unsigned long long utime = 0, stime = 0;
+  long tick = sysconf(_SC_CLK_TCK);
+  FILE *f;
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+  if((f = fopen(path, "r")) && fgets(buf, sizeof(buf), f) && (p = strrchr(buf, ')')))
+    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+           &utime, &stime);
+  if(f)
+    fclose(f);
+  *user_ns = utime * 1000000000LL / tick;
+  *cpu_ns = (utime + stime) * 1000000000LL / tick;
+  *syscr = *syscw = 0;
+  snprintf(path, sizeof(path), "/proc/%d/io", (int) pid);
+  if(!(f = fopen(path, "r")))
+    return;
+  while(fgets(buf, sizeof(buf), f)) {
+    sscanf(buf, "syscr: %lld", syscr);
+    sscanf(buf, "syscw: %lld", syscw); }
+  fclose(f); }
+
+static void start_plom_ii(int port, int argc, char *argv[]) {
+// Run plom-ii on dir, connecting to port, without pacing; with argv[] options
+// (which may override -r).
+  char portstr[8], **args;
+  int i, n = 0;
+  if(!mkdtemp(dir))
+    fail("plom-ii-bench: cannot create irc directory");
+  snprintf(portstr, sizeof(portstr), "%d", port);
+  if(!(args = calloc(argc + 12, sizeof(char *))))
+    fail("plom-ii-bench: cannot allocate memory");
+  args[n++] = plom_ii;
+  args[n++] = "-r";
+  args[n++] = "0";
+  for(i = 0; i < argc; i++)
+    args[n++] = argv[i];
+  args[n++] = "-i";
+  args[n++] = dir;
+  args[n++] = "-s";
+  args[n++] = HOST;
+  args[n++] = "-p";
+  args[n++] = portstr;
+  args[n++] = "-n";
+  args[n++] = NICK;
+  if((pid = fork()) == -1)
+    fail("plom-ii-bench: cannot fork");
+  if(!pid) {
+    execv(plom_ii, args);
+    perror("plom-ii-bench: cannot run plom-ii");
+    _exit(EXIT_FAILURE); }
+  free(args); }
+
+static void queue(const char *fmt, ...) {
+// Append printf()'d line plus "\r\n" to lines for plom-ii.
+  va_list ap;
+  int len;
+  va_start(ap, fmt);
+  len = vsnprintf(sendbuf + send_len, MAX_LINE - 1, fmt, ap);
+  va_end(ap);
+  if(len > MAX_LINE - 2)
+    len = MAX_LINE - 2;
+  memcpy(sendbuf + send_len + len, "\r\n", 2);
+  send_len += len + 2; }
+
+static void pad(char *buf, int len) {
+// Fill buf[] with len bytes of words, '\0'-terminate it.
+  static const char words[] = "lorem ipsum dolor sit amet consectetur adipiscing elit ";
+  int i;
+  for(i = 0; i < len; i++)
+    buf[i] = words[i % (sizeof(words) - 1)];
+  buf[len > 0 ? len : 0] = 0; }
+
+static void proc_irc_line(char *line) {
+// Handle line from plom-ii: welcome it after login; take the time a fifo line
+// took to arrive.
+  char *p;
+  if(!logged_in && !strncmp(line, "USER ", 5)) {
+    logged_in = 1;
+    queue(":%s 001 %s :Welcome to plom-ii-bench", HOST, NICK); }
+  else if(!strncmp(line, "PING ", 5))
+    queue(":%s PONG %s :%s", HOST, HOST, line + 5);
+  else if(!strncmp(line, "PRIVMSG ", 8) && (p = strstr(line, " :fifo "))) {
+    add_sample(&fifo_lat, now_ns() - strtoll(p + 7, NULL, 10));
+    fifo_echoed++; } }
+
+static void read_irc() {
+// Read what plom-ii sent, handle each complete line.
+  char *p, *nl;
+  ssize_t n;
+  while((n = read(irc, inbuf + in_len, sizeof(inbuf) - in_len)) > 0) {
+    in_len += n;
+    for(p = inbuf; (nl = memchr(p, '\n', inbuf + in_len - p)); p = nl + 1) {
+      *nl = 0;
+      if(nl > p && nl[-1] == '\r')
+        nl[-1] = 0;
+      proc_irc_line(p); }
+    in_len -= p - inbuf;
+    memmove(inbuf, p, in_len);
+    if(in_len == sizeof(inbuf))
+      in_len = 0; }
+  if(!n || errno != EAGAIN) {
+    errno = n ? errno : ECONNRESET;
+    fail("plom-ii-bench: lost connection from plom-ii"); } }
+
+static void write_irc() {
+// Write as many queued lines to plom-ii as it takes.
+  ssize_t n = write(irc, sendbuf, send_len);
+  if(n < 0) {
+    if(errno != EAGAIN)
+      fail("plom-ii-bench: cannot write to plom-ii");
+    return; }
+  send_len -= n;
+  memmove(sendbuf, sendbuf + n, send_len); }
+
+static void open_probe() {
+// (Re-)open PROBE's out file, at its start; watch for its growth.
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s/%s/out", dir, HOST, PROBE);
+  if(probe_fd != -1)
+    close(probe_fd);
+  probe_len = 0;
+  if((probe_fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ||
+     inotify_add_watch(in_fd, path, IN_MODIFY) == -1)
+    fail("plom-ii-bench: cannot watch probe out file"); }
+
+static void read_probe() {
+// Read PROBE's out file to its end; take the time each probe took to arrive.
+// On "end", note the flood is through.
+  char buf[INBUF], *p, *nl, *t;
+  ssize_t n;
+  size_t l;
+  long long now = now_ns();
+  while((n = read(probe_fd, buf, sizeof(buf))) > 0)
+    for(p = buf; p < buf + n; p = nl + 1) {
+      if(!(nl = memchr(p, '\n', buf + n - p))) {
+        l = buf + n - p;
+        if(probe_len + l < sizeof(probe_part)) {
+          memcpy(probe_part + probe_len, p, l);
+          probe_len += l; }
+        break; }
+      l = nl - p;
+      if(probe_len + l < sizeof(probe_part)) {
+        memcpy(probe_part + probe_len, p, l);
+        probe_len += l; }
+      probe_part[probe_len] = 0;
+      probe_len = 0;
+      if((t = strstr(probe_part, " :probe "))) {
+        if(!strncmp(t + 8, "end ", 4))
+          end_ns = now;
+        add_sample(&out_lat, now - strtoll(t + 8 + 4 * !strncmp(t + 8, "end ", 4),
+                                           NULL, 10)); } } }
+
+static void handle_inotify() {
+// Read PROBE's out file on growth; re-open it if it was rotated.
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *e;
+  ssize_t n;
+  char *p;
+  while((n = read(in_fd, buf, sizeof(buf))) > 0)
+    for(p = buf; p < buf + n; p += sizeof(*e) + e->len) {
+      e = (struct inotify_event *) p;
+      if(e->mask & IN_CREATE && e->len && !strcmp(e->name, "out")) {
+        read_probe();
+        open_probe(); } }
+  read_probe(); }
+
+static void pump(int ms) {
+// Wait up to ms (-1: forever) for plom-ii's output, room to write to it or
+// PROBE's out file growing; handle what happened.
+  struct pollfd pfd[2] = { { irc, POLLIN | (send_len ? POLLOUT : 0), 0 },
+                           { in_fd, POLLIN, 0 } };
+  if(poll(pfd, 2, ms) == -1 && errno != EINTR)
+    fail("plom-ii-bench: cannot poll");
+  if(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+    read_irc();
+  if(pfd[0].revents & POLLOUT)
+    write_irc();
+  if(pfd[1].revents & POLLIN)
+    handle_inotify(); }
+
+static void accept_irc(int listener) {
+// Accept plom-ii's connection, or fail if it does not come in time.
+  struct pollfd pfd = { listener, POLLIN, 0 };
+  if(poll(&pfd, 1, SETUP_TIMEOUT) != 1 ||
+     (irc = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+    errno = errno ? errno : ETIMEDOUT;
+    fail("plom-ii-bench: no connection from plom-ii"); }
+  close(listener); }
+
+static int open_fifo(int k) {
+// Try to open fifo of channel #c<k> for writing, return descriptor or -1.
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s/#c%d/in", dir, HOST, k);
+  return open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC); }
+
+static void set_up() {
+// Log plom-ii in, make it join PROBE and the channels; wait until the
+// channels' fifos can be opened and PROBE's out file exists.
+  char path[PATH_MAX];
+  long long deadline = now_ns() + SETUP_TIMEOUT * 1000000LL;
+  int k, missing;
+  while(!logged_in && now_ns() < deadline)
+    pump(100);
+  queue(":%s!u@%s JOIN %s", NICK, HOST, PROBE);
+  for(k = 0; k < n_channels; k++) {
+    queue(":%s!u@%s JOIN #c%d", NICK, HOST, k);
+    if(send_len > SENDBUF - MAX_LINE)
+      while(send_len && now_ns() < deadline)
+        pump(100); }
+  if(!(fifos = malloc(n_channels * sizeof(int))))
+    fail("plom-ii-bench: cannot allocate memory");
+  for(k = 0; k < n_channels; k++)
+    fifos[k] = -1;
+  snprintf(path, sizeof(path), "%s/%s/%s/out", dir, HOST, PROBE);
+  do {
+    pump(10);
+    for(k = missing = 0; k < n_channels; k++)
+      if(fifos[k] == -1)
+        missing += (fifos[k] = open_fifo(k)) == -1; }
+  while((missing || access(path, F_OK)) && now_ns() < deadline);
+  if(missing || access(path, F_OK)) {
+    errno = ETIMEDOUT;
+    fail("plom-ii-bench: plom-ii did not join all channels"); }
+  snprintf(path, sizeof(path), "%s/%s/%s", dir, HOST, PROBE);
+  if(inotify_add_watch(in_fd, path, IN_CREATE) == -1)
+    fail("plom-ii-bench: cannot watch probe directory");
+  open_probe();
+  read_probe();
+  out_lat.n = 0; }
+
+static void queue_flood_line(long long i) {
+// Queue server line i of the flood: a probe, or one of mix[] to a random channel.
+// PARTs go to channels #p<k> instead of #c<k>: plom-ii removes a channel (and
+// its fifo) on anyone's PART, which would drop the fifo lines written to it.
+  static char text[MAX_LINE];
+  int k = rand() % n_channels, r = rand() % 100, user = rand() % 1000, len;
+  if(!(i % probe_every)) {
+    queue(":%s!u@%s PRIVMSG %s :probe %lld", NICK, HOST, PROBE, now_ns());
+    return; }
+  if((r -= mix[0]) < 0) {
+    len = snprintf(NULL, 0, ":u%d!u@%s PRIVMSG #c%d :", user, HOST, k);
+    pad(text, line_size - len);
+    queue(":u%d!u@%s PRIVMSG #c%d :%s", user, HOST, k, text); }
+  else if((r -= mix[1]) < 0)
+    queue(":u%d!u@%s JOIN #c%d", user, HOST, k);
+  else if((r -= mix[2]) < 0) {
+    len = snprintf(NULL, 0, ":u%d!u@%s PART #p%d :", user, HOST, k);
+    pad(text, line_size - len);
+    queue(":u%d!u@%s PART #p%d :%s", user, HOST, k, text); }
+  else {
+    len = snprintf(text, sizeof(text), "%s", NICK);
+    while(len + 6 < line_size - 40 && len + 6 < (int) sizeof(text))
+      len += sprintf(text + len, " u%03d", rand() % 1000);
+    queue(":%s 353 %s = #c%d :%s", HOST, NICK, k, text); } }
+
+static void write_fifo_line(int k) {
+// Write a timestamped line for the server to channel #c<k>'s fifo; re-open it
+// if plom-ii closed it (channel parted).
+  char line[MAX_LINE], text[MAX_LINE];
+  int len = snprintf(line, sizeof(line), "PRIVMSG #c%d :fifo %lld ", k, now_ns());
+  pad(text, line_size - len);
+  len += snprintf(line + len, sizeof(line) - len, "%s\n", text);
+  if(fifos[k] == -1)
+    fifos[k] = open_fifo(k);
+  if(fifos[k] != -1 && write(fifos[k], line, len) == len) {
+    fifo_sent++;
+    return; }
+  if(fifos[k] != -1 && errno != EAGAIN) {
+    close(fifos[k]);
+    fifos[k] = -1; }
+  fifo_dropped++; }
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_in addr = { AF_INET };
+  socklen_t addrlen = sizeof(addr);
+  long long start, now, due, fifo_due, generated = 0, fifo_k = 0, waited;
+  long long cpu0, user0, syscr0, syscw0, cpu, user, syscr, syscw, handled;
+  int i, listener;
+
+  // Read options; those after "--" are plom-ii's.
+  for(i = 1; i < argc && strcmp(argv[i], "--"); i++) {
+    if(argv[i][0] != '-' || i + 1 == argc)
+      usage();
+    switch(argv[i][1]) {
+      case 'n': n_lines = strtoll(argv[++i], NULL, 10); break;
+      case 'c': n_channels = strtol(argv[++i], NULL, 10); break;
+      case 's': line_size = strtol(argv[++i], NULL, 10); break;
+      case 'r': rate = strtoll(argv[++i], NULL, 10); break;
+      case 'f': fifo_rate = strtoll(argv[++i], NULL, 10); break;
+      case 'e': probe_every = strtol(argv[++i], NULL, 10); break;
+      case 'x': plom_ii = argv[++i]; break;
+      case 'm':
+        if(sscanf(argv[++i], "%d,%d,%d,%d", &mix[0], &mix[1], &mix[2], &mix[3]) != 4 ||
+           mix[0] + mix[1] + mix[2] + mix[3] != 100)
+          usage();
+        break;
+      default: usage(); } }
+  if(n_lines < 1 || n_channels < 1 || probe_every < 1 || line_size > MAX_LINE - 2)
+    usage();
+  i += i < argc;
+
+  // Listen on a free local port, run plom-ii against it, set it up.
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if((listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+     bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+     listen(listener, 1) == -1 ||
+     getsockname(listener, (struct sockaddr *) &addr, &addrlen) == -1)
+    fail("plom-ii-bench: cannot listen");
+  if((in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+    fail("plom-ii-bench: cannot set up inotify");
+  signal(SIGPIPE, SIG_IGN);
+  atexit(cleanup);
+  start_plom_ii(ntohs(addr.sin_port), argc - i, argv + i);
+  accept_irc(listener);
+  set_up();
+  srand(1);
+
+  // Flood: queue server lines as rate allows and the send buffer takes them,
+  // write fifo lines as fifo_rate allows; then a last probe to tell the end.
+  proc_stats(&cpu0, &user0, &syscr0, &syscw0);
+  start = now_ns();
+  while(generated < n_lines) {
+    now = now_ns();
+    due = rate ? (now - start) * rate / 1000000000 : n_lines;
+    due = due < n_lines ? due : n_lines;
+    while(generated < due && send_len <= SENDBUF - MAX_LINE)
+      queue_flood_line(generated++);
+    for(fifo_due = (now - start) * fifo_rate / 1000000000;
+        fifo_sent + fifo_dropped < fifo_due; fifo_k++)
+      write_fifo_line(fifo_k % n_channels);
+    pump(send_len > SENDBUF - MAX_LINE ? 100 : generated < due ? 0 : 1); }
+  queue(":%s!u@%s PRIVMSG %s :probe end %lld", NICK, HOST, PROBE, now_ns());
+  for(waited = now_ns(); !end_ns && now_ns() - waited < END_TIMEOUT * 1000000LL; ) {
+    i = out_lat.n;
+    pump(100);
+    if(out_lat.n != i)
+      waited = now_ns(); }
+  if(!end_ns) {
+    errno = ETIMEDOUT;
+    fail("plom-ii-bench: last probe never arrived"); }
+  proc_stats(&cpu, &user, &syscr, &syscw);
+  for(waited = now_ns(); fifo_echoed < fifo_sent &&
+      now_ns() - waited < DRAIN_TIMEOUT * 1000000LL; )
+    pump(100);
+
+  // Report.
+  handled = n_lines + 1 + fifo_sent;
+  printf("plom-ii-bench: %lld server lines of ~%d bytes (%d%% PRIVMSG, %d%% JOIN, "
+         "%d%% PART, %d%% 353) to %d channels, %lld fifo lines written (%lld "
+         "not: fifo full / gone; %lld never sent on)\n", n_lines, line_size, mix[0], mix[1], mix[2], mix[3],
+         n_channels, fifo_sent, fifo_dropped, fifo_sent - fifo_echoed);
+  printf("  throughput %.0f server lines/s (%.3f s)\n",
+         n_lines * 1e9 / (end_ns - start), (end_ns - start) / 1e9);
+  printf("  cpu        %.2f us per line (user %.2f, system %.2f), server and fifo lines\n",
+         (cpu - cpu0) / 1e3 / handled, (user - user0) / 1e3 / handled,
+         (cpu - cpu0 - user + user0) / 1e3 / handled);
+  printf("  syscalls   %.3f read-, %.3f write-class per line\n",
+         (double) (syscr - syscr0) / handled, (double) (syscw - syscw0) / handled);
+  print_latency("server line to out:", &out_lat);
+  print_latency("fifo line to server:", &fifo_lat);
+  return 0; }
@@ -0,0 +1,386 @@
+// plom-ii-micro: time plom-ii's per-line functions over a corpus, fuzz its parser
+//
+// plom-ii-micro is licensed under the GPL v3 or any later version; see file
+// LICENSE or <http://www.gnu.org/licenses/gpl-3.0.html>.
+//
+// Built from plom-ii.c itself (its main() renamed, its malloc() family calls
+// counted), so it times the very code plom-ii runs. With -DLIBFUZZER, it is a
+// libFuzzer target for parse_message() instead.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <ftw.h>
+#include <stdint.h>
+
+static long long allocs = 0; /* malloc() family calls of plom-ii.c code */
+
+static void *count_malloc(size_t size) {
+  allocs++;
+  return malloc(size); }
+
+static void *count_calloc(size_t n, size_t size) {
+  allocs++;
+  return calloc(n, size); }
+
+#define malloc(size) count_malloc(size)
+#define calloc(n, size) count_calloc(n, size)
+#define main plom_ii_main
+#define usage plom_ii_usage
+#include "plom-ii.c"
+#undef main
+#undef usage
+#undef malloc
+#undef calloc
+
+#define STREAM_MAX (LINEBUF_SIZE - PIPE_BUF) /* bytes per split_lines() at most */
+#define MUTATIONS 8 /* per fuzzed line at most */
+
+typedef struct Stage Stage;
+struct Stage {            /* function timed over corpus lines */
+  char *name;
+  void (*run)(int i);     /* on corpus line i */
+  void (*pass)();         /* after each pass over the corpus, if set */
+  char *note; };
+
+// Corpus: n_corpus lines (without "\r\n"), each also parsed into msgs[];
+// stream[] holds them all "\r\n"-terminated, as read from a server socket.
+static char *corpus_path = "microbench.irc";
+static char **corpus;
+static Message *msgs;
+static char *targets; /* per line, PIPE_BUF bytes: its param 0 (or command) */
+static int n_corpus = 0;
+static char *stream;
+static size_t stream_len = 0;
+static long long stage_lines = 500000, fuzz_rounds = 200000;
+static size_t read_size = PIPE_BUF; /* bytes split_lines() at once */
+static unsigned seed = 1;
+
+static char tmpdir[] = "/tmp/plom-ii-micro-XXXXXX"; /* for proc_server_cmd() */
+static Server micro_srv = { WATCH_SERVER };
+static Linebuf micro_lb;
+static long long sink = 0; /* of results, so no stage is optimized away */
+
+static void print_line(FILE *f, const char *line) {
+// Print line[] to f, non-printable bytes escaped.
+  for(; *line; line++)
+    if(isprint((unsigned char) *line))
+      fputc(*line, f);
+    else
+      fprintf(f, "\\x%02x", (unsigned char) *line);
+  fputc('\n', f); }
+
+static void ref_slice(const char *line, size_t from, size_t to, Slice *s) {
+// Set s to line[from..to).
+  s->s = (char *) line + from;
+  s->len = to - from; }
+
+static void ref_parse(const char *line, Message *m) {
+// Split line[] into m the way parse_message() is to: the reference it is
+// checked against, written for clarity (strspn() / strcspn() over indexes).
+  size_t i = strspn(line, " "), end;
+  m->tags.s = m->prefix.s = NULL;
+  m->tags.len = m->prefix.len = 0;
+  m->nparams = 0;
+  if(line[i] == '@') {
+    end = i + 1 + strcspn(line + i + 1, " ");
+    ref_slice(line, i + 1, end, &m->tags);
+    i = end + strspn(line + end, " "); }
+  if(line[i] == ':') {
+    end = i + 1 + strcspn(line + i + 1, " ");
+    ref_slice(line, i + 1, end, &m->prefix);
+    i = end + strspn(line + end, " "); }
+  end = i + strcspn(line + i, " ");
+  ref_slice(line, i, end, &m->cmd);
+  for(i = end; m->nparams < MAX_PARAMS; i = end) {
+    i += strspn(line + i, " ");
+    if(!line[i])
+      break;
+    if(line[i] == ':' || m->nparams == MAX_PARAMS - 1) {
+      i += line[i] == ':';
+      ref_slice(line, i, strlen(line), &m->param[m->nparams++]);
+      break; }
+    end = i + strcspn(line + i, " ");
+    ref_slice(line, i, end, &m->param[m->nparams++]); } }
+
+static int same_slice(Slice *a, Slice *b) {
+// Return whether a and b are the same part of a line (both empty counts).
+  return a->len == b->len && (!a->len || a->s == b->s); }
+
+static void check_parse(char *line) {
+// parse_message() line[]; abort if the result differs from ref_parse()'s.
+  Message m, ref;
+  int i, ok;
+  parse_message(&micro_srv, line, &m);
+  ref_parse(line, &ref);
+  ok = m.line == line && m.nparams == ref.nparams && same_slice(&m.tags, &ref.tags) &&
+       same_slice(&m.prefix, &ref.prefix) && same_slice(&m.cmd, &ref.cmd);
+  for(i = 0; ok && i < m.nparams; i++)
+    ok = same_slice(&m.param[i], &ref.param[i]);
+  if(ok)
+    return;
+  fprintf(stderr, "plom-ii-micro: parse_message() differs from reference on:\n");
+  print_line(stderr, line);
+  abort(); }
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+// Check parse_message() on data as one line (cut like split_lines() does).
+  char line[PIPE_BUF];
+  size = size < PIPE_BUF - 1 ? size : PIPE_BUF - 1;
+  memcpy(line, data, size);
+  line[size] = 0;
+  check_parse(line);
+  return 0; }
+#else
+
+static void usage() {
+// Print help message.
+  fprintf(stderr, "%s",
+          "usage: plom-ii-micro [-c <corpus file>] [-n <lines per stage>]\n"
+          "          [-k <bytes per read>] [-z <fuzzed lines>] [-S <seed>]\n");
+  exit(EXIT_FAILURE); }
+
+static void fail(const char *msg) {
+// Print msg and errno's description, exit.
+  perror(msg);
+  exit(EXIT_FAILURE); }
+
+static long long clock_ns() {
+// Return monotonic clock time in ns.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec; }
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+// nftw() callback: remove path.
+  remove(path);
+  return 0; }
+
+static void cleanup() {
+// Remove tmpdir with all in it.
+  nftw(tmpdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS); }
+
+static void load_corpus() {
+// Read corpus_path's lines into corpus[], stream[]; parse them into msgs[].
+  static char buf[PIPE_BUF];
+  FILE *f = fopen(corpus_path, "r");
+  size_t len, cap = 0, stream_cap = 0;
+  Slice *t;
+  int i;
+  if(!f)
+    fail("plom-ii-micro: cannot open corpus");
+  while(fgets(buf, sizeof(buf), f)) {
+    len = strcspn(buf, "\r\n");
+    buf[len] = 0;
+    if(n_corpus == cap) {
+      cap = cap ? cap * 2 : 256;
+      if(!(corpus = realloc(corpus, cap * sizeof(char *))))
+        fail("plom-ii-micro: cannot allocate memory"); }
+    if(stream_len + len + 2 > stream_cap) {
+      stream_cap = (stream_len + len + 2) * 2;
+      if(!(stream = realloc(stream, stream_cap)))
+        fail("plom-ii-micro: cannot allocate memory"); }
+    if(!(corpus[n_corpus++] = strdup(buf)))
+      fail("plom-ii-micro: cannot allocate memory");
+    memcpy(stream + stream_len, buf, len);
+    memcpy(stream + stream_len + len, "\r\n", 2);
+    stream_len += len + 2; }
+  fclose(f);
+  if(!n_corpus) {
+    fprintf(stderr, "plom-ii-micro: corpus is empty\n");
+    exit(EXIT_FAILURE); }
+  if(!(msgs = malloc(n_corpus * sizeof(Message))) ||
+     !(targets = malloc((size_t) n_corpus * PIPE_BUF)))
+    fail("plom-ii-micro: cannot allocate memory");
+  for(i = 0; i < n_corpus; i++) {
+    check_parse(corpus[i]);
+    parse_message(&micro_srv, corpus[i], &msgs[i]);
+    t = msgs[i].nparams ? &msgs[i].param[0] : &msgs[i].cmd;
+    snprintf(targets + (size_t) i * PIPE_BUF, PIPE_BUF, "%.*s", (int) t->len, t->s); } }
+
+static void count_line(char *line, void *arg) {
+// split_lines() handler: just count line.
+  sink += line[0]; }
+
+static void run_split(int i) {
+// split_lines() all of stream, read_size bytes at a time, on corpus line 0
+// (and nothing on the others, to time per line rather than per read).
+  size_t pos, n;
+  if(i)
+    return;
+  for(pos = 0; pos < stream_len; pos += n) {
+    n = stream_len - pos < read_size ? stream_len - pos : read_size;
+    memcpy(chunk, micro_lb.part, micro_lb.len);
+    memcpy(chunk + micro_lb.len, stream + pos, n);
+    split_lines(&micro_lb, n, count_line, NULL); } }
+
+static void run_parse(int i) {
+  Message m;
+  parse_message(&micro_srv, corpus[i], &m);
+  sink += m.nparams + m.cmd.len; }
+
+static void run_striplower(int i) {
+// striplower() a copy of line i's target (copying included in time).
+  char name[PIPE_BUF];
+  strcpy(name, targets + (size_t) i * PIPE_BUF);
+  sink += striplower(name)[0]; }
+
+static void run_find_handler(int i) {
+  sink += find_handler(&msgs[i].cmd) != NULL; }
+
+static void run_count_command(int i) {
+  count_command(&micro_srv.stats, &msgs[i].cmd); }
+
+static void run_proc_server_cmd(int i) {
+  proc_server_cmd(corpus[i], &micro_srv); }
+
+static void pass_proc_server_cmd() {
+// What run() does per event batch: write out appends, free PARTed channels;
+// throw away queued JOINs (nothing to send them to).
+  commit_outfiles();
+  free_dead();
+  micro_srv.bulk.len = micro_srv.urgent.len = 0; }
+
+static Stage stages[] = {
+  { "split_lines", run_split, NULL, "stream of lines cut into reads" },
+  { "parse_message", run_parse, NULL, NULL },
+  { "striplower", run_striplower, NULL, "a copy of param 0" },
+  { "find_handler", run_find_handler, NULL, NULL },
+  { "count_command", run_count_command, NULL, NULL },
+  { "proc_server_cmd", run_proc_server_cmd, pass_proc_server_cmd,
+    "all of it, to out files in /tmp" } };
+
+static void time_stage(Stage *st) {
+// Run st over the corpus, once to warm up, then for stage_lines lines at
+// least; print ns and allocations per line.
+  long long lines = 0, start, ns, allocs_start;
+  int i;
+  for(i = 0; i < n_corpus; i++)
+    st->run(i);
+  if(st->pass)
+    st->pass();
+  allocs_start = allocs;
+  start = clock_ns();
+  while(lines < stage_lines) {
+    for(i = 0; i < n_corpus; i++)
+      st->run(i);
+    if(st->pass)
+      st->pass();
+    lines += n_corpus; }
+  ns = clock_ns() - start;
+  printf("  %-16s %9.1f ns per line %8.4f allocs per line%s%s%s\n", st->name,
+         (double) ns / lines, (double) (allocs - allocs_start) / lines,
+         st->note ? " (" : "", st->note ? st->note : "", st->note ? ")" : ""); }
+
+static void mutate(char *line) {
+// Change line[] (of less than PIPE_BUF bytes, kept so) at a few random places,
+// favouring the bytes parse_message() cares about.
+  static const char special[] = " :@!\001\r";
+  size_t len = strlen(line), at;
+  int n = 1 + rand() % MUTATIONS;
+  char c;
+  while(n--) {
+    at = len ? rand() % (len + 1) : 0;
+    c = rand() % 4 ? special[rand() % (sizeof(special) - 1)] : 1 + rand() % 255;
+    switch(rand() % 4) {
+      case 0: /* overwrite */
+        if(at < len)
+          line[at] = c;
+        break;
+      case 1: /* insert */
+        if(len + 1 < PIPE_BUF) {
+          memmove(line + at + 1, line + at, len - at + 1);
+          line[at] = c;
+          len++; }
+        break;
+      case 2: /* delete */
+        if(at < len) {
+          memmove(line + at, line + at + 1, len - at);
+          len--; }
+        break;
+      default: /* cut */
+        line[at] = 0;
+        len = at; } } }
+
+static void fuzz() {
+// check_parse() fuzz_rounds mutated corpus lines, and some of random bytes.
+  char line[PIPE_BUF];
+  long long k;
+  size_t i, len;
+  for(k = 0; k < fuzz_rounds; k++) {
+    if(k % 16) {
+      snprintf(line, sizeof(line), "%s", corpus[rand() % n_corpus]);
+      mutate(line); }
+    else {
+      len = rand() % 64;
+      for(i = 0; i < len; i++)
+        line[i] = " :@a\001"[rand() % 5];
+      line[len] = 0; }
+    check_parse(line); } }
+
+int main(int argc, char *argv[]) {
+  int i;
+  for(i = 1; i < argc; i++) {
+    if(argv[i][0] != '-' || !argv[i][1] || argv[i][2] || i + 1 >= argc)
+      usage();
+    switch(argv[i][1]) {
+      case 'c': corpus_path = argv[++i]; break;
+      case 'n': stage_lines = strtoll(argv[++i], NULL, 10); break;
+      case 'k': read_size = strtoul(argv[++i], NULL, 10); break;
+      case 'z': fuzz_rounds = strtoll(argv[++i], NULL, 10); break;
+      case 'S': seed = strtoul(argv[++i], NULL, 10); break;
+      default: usage(); } }
+  if(!read_size || read_size > STREAM_MAX)
+    usage();
+  srand(seed);
+
+  // Set up a server as plom-ii's main() does, minus resolving, in tmpdir.
+  if(!mkdtemp(tmpdir))
+    fail("plom-ii-micro: cannot create directory");
+  atexit(cleanup);
+  if((epfd = epoll_create1(0)) == -1)
+    fail("plom-ii-micro: cannot set up epoll");
+  micro_srv.irc = -1;
+  micro_srv.host = "irc.example.net";
+  snprintf(micro_srv.nick, sizeof(micro_srv.nick), "me");
+  snprintf(micro_srv.path, sizeof(micro_srv.path), "%s/%s", tmpdir, micro_srv.host);
+  create_dirtree(micro_srv.path);
+  add_channel(&micro_srv, "");
+  servers = &micro_srv;
+
+  load_corpus();
+  printf("plom-ii-micro: %d corpus lines (%zu bytes) from %s, %lld lines per stage\n",
+         n_corpus, stream_len, corpus_path, stage_lines);
+  for(i = 0; i < (int) (sizeof(stages) / sizeof(stages[0])); i++)
+    time_stage(&stages[i]);
+  fuzz();
+  printf("  fuzz: %lld mutated lines parsed as by the reference tokenizer (seed %u)\n",
+         fuzz_rounds, seed);
+  return 0; }
+#endif
@@ -1,109 +1,700 @@
+#define _GNU_SOURCE
 #include <ncurses.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+#define SCAN_CHUNK (1 << 20) /* bytes searched for line ends at once */
+#define LINES_MIN 4096 /* initial capacity of line index */
+#define PATTERN_MAX 256 /* bytes of a search pattern, '\0' included */
+#define STATUS_MAX 512 /* bytes of the status row, '\0' included */
+#define RESERVE (1LL << 32) /* address space kept free beyond a mapped file */
+#define RING_MAGIC 0x706c6f6d /* of an initialized Ring, as in plom-ii */
+
+typedef struct Ring Ring;
+struct Ring {     /* plom-ii's shared memory of a channel's recent out lines */
+  unsigned magic;
+  unsigned size;  /* bytes of data[], a power of 2 */
+  unsigned long long seq; /* bytes ever appended, last ones in data[] */
+  unsigned long long wseq; /* seq an append in progress will end at */
+  long long base; /* seq minus outfile offset of the same byte ... */
+  unsigned long long ino; /* ... in the outfile of this inode */
+  unsigned futex; /* bumped on each append; waked if there are ... */
+  unsigned waiters; /* ... readers waiting on it */
+  char data[]; };
+
+// Log file, mapped; starts of its lines found so far, i.e. of all those at or
+// after offset back: a deque in lines[head..head+n_lines), growing to the front
+// as scanning goes on backwards from the file end.
+// Address space is reserved beyond the mapped file, for lines appended to it to
+// be copied there from plom-ii's Ring for the file, if there is one.
+static char *path, *map = NULL;
+static int fd = -1, inflated = 0; /* map is malloc()'d, from a gzip'd file */
+static off_t reserved = 0; /* bytes of address space at map, unless inflated */
+static off_t file_mapped = 0, backed = 0; /* bytes at map of pages mapped from
+                              the file / of those or anonymous ones following */
+static long page;
+static off_t size = 0, back = 0;
+static ino_t ino;
+static off_t *lines = NULL;
+static size_t cap = 0, head = 0, n_lines = 0;
+static size_t top = 0; /* index of first line on screen, relative to head */
+static size_t unseen = 0; /* lines appended below screen while scrolled up */
+static int rows, cols;
+static struct { off_t start, len; } *shown = NULL; /* part of file on each
+                                          screen row; start -1: redraw row */
+static int in_fd, file_wd = -1; /* inotify instance, watch of path's file */
+
+// Segments rotated out of the file at live: files named like it plus a dot and
+// a suffix (other than ".idx", ".tmp"), plain or gzip'd, in order of their
+// names (sans ".gz"). The one shown, if not live, is segments[segment].
+static char *live, **segments = NULL;
+static int n_segments = 0, segment = -1;
+
+// Ring of live's recent lines, its position matching the end of map; the
+// wait_ring() thread tells of appends through woken[].
+static Ring *ring = NULL;
+static unsigned long long ring_pos;
+static int woken[2];
+
+// Search: pattern (a POSIX extended regex if regex is set) typed after '/' or
+// '?' into typed[], searched for forward / backward chunk by chunk between
+// keypresses; last match found. msg[] tells of failures until the next key.
+static char pattern[PATTERN_MAX], typed[PATTERN_MAX], msg[STATUS_MAX];
+static size_t pattern_len = 0;
+static int regex = 0, compiled = 0, highlight = 0;
+static regex_t re;
+static int prompting = 0; /* '/' or '?' while a pattern is typed */
+static int searching = 0; /* 1 / -1 while searching forward / backward */
+static off_t search_pos;  /* next chunk starts / ends here */
+static off_t match = -1, match_len;
+
+static void fail (char *msg) {
+// Leave curses mode, print msg and system error, exit.
+  endwin();
+  perror(msg);
+  exit(1); }
+
+static void prepend_line (off_t start) {
+// Add line start in front of lines[], doubling its capacity (known starts
+// moving to its end) if there is no room. Keep top on the same line.
+  off_t *new;
+  size_t new_cap;
+  if (!head) {
+    new_cap = cap ? cap * 2 : LINES_MIN;
+    if (!(new = malloc(new_cap * sizeof(off_t))))
+      fail("plom-ii-view: cannot allocate memory");
+    memcpy(new + new_cap - n_lines, lines, n_lines * sizeof(off_t));
+    free(lines);
+    lines = new;
+    head = new_cap - n_lines;
+    cap = new_cap; }
+  lines[--head] = start;
+  n_lines++;
+  top++; }
+
+static void append_line (off_t start) {
+// Add line start at end of lines[], doubling its capacity if there is no room.
+  if (head + n_lines == cap) {
+    cap = cap ? cap * 2 : LINES_MIN;
+    if (!(lines = realloc(lines, cap * sizeof(off_t))))
+      fail("plom-ii-view: cannot allocate memory"); }
+  lines[head + n_lines++] = start; }
+
+static void scan_back (size_t want) {
+// Index line starts before back, SCAN_CHUNK bytes at a time (with memrchr(),
+// vectorized in any decent libc), until want more are known or the file start
+// is reached.
+  size_t added = 0;
+  off_t lo;
+  char *p;
+  while (back > 0 && added < want) {
+    lo = back > SCAN_CHUNK ? back - SCAN_CHUNK : 0;
+    while (back > lo && (p = memrchr(map + lo, '\n', back - lo))) {
+      back = p - map;
+      if (back + 1 < size) {
+        prepend_line(back + 1);
+        added++; } }
+    back = lo;
+    if (!back) {
+      prepend_line(0);
+      added++; } } }
+
+static void inflate_log (int gz_fd, off_t gz_size) {
+// Read gzip'd file of gz_fd (gz_size bytes) into map, sets size.
+  gzFile gz = gzdopen(dup(gz_fd), "rb");
+  size_t map_size = gz_size * 4 + 1;
+  int n;
+  if (!gz || !(map = malloc(map_size)))
+    fail("plom-ii-view: cannot inflate file");
+  while ((n = gzread(gz, map + size, map_size - size > INT_MAX ? INT_MAX : map_size - size)) > 0)
+    if ((size += n) == map_size && !(map = realloc(map, map_size *= 2)))
+      fail("plom-ii-view: cannot allocate memory");
+  gzclose(gz);
+  inflated = 1; }
+
+static int open_log (int at_end) {
+// (Re-)map file at path (or, if gzip'd, read it inflated), index lines of its
+// last screen and show that; or, unless at_end, index all lines, show first.
+// Return 0 if path cannot be opened.
+  struct stat st;
+  int y, new_fd;
+  size_t len = strlen(path);
+  if ((new_fd = open(path, O_RDONLY)) == -1 || fstat(new_fd, &st) == -1) {
+    if (new_fd != -1)
+      close(new_fd);
+    return 0; }
+  if (inflated)
+    free(map);
+  else if (map)
+    munmap(map, reserved);
+  if (fd != -1)
+    close(fd);
+  fd = new_fd;
+  map = NULL;
+  size = inflated = 0;
+  ino = st.st_ino;
+  if (len > 3 && !strcmp(path + len - 3, ".gz"))
+    inflate_log(fd, st.st_size);
+  else {
+    size = st.st_size;
+    file_mapped = backed = (size + page - 1) & ~(page - 1);
+    reserved = file_mapped + RESERVE;
+    if ((map = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1, 0)) == MAP_FAILED ||
+        (size && mmap(map, size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))
+      fail("plom-ii-view: cannot map file"); }
+
+  // Follow the file through its Ring, if it has one, else through inotify.
+  if (ring && path == live)
+    ring_pos = size + ring->base;
+  if (file_wd != -1)
+    inotify_rm_watch(in_fd, file_wd);
+  file_wd = inotify_add_watch(in_fd, path, (ring && path == live ? 0 : IN_MODIFY) |
+                                           IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  for (y = 0; y < rows; y++)
+    shown[y].start = -1;
+  head = cap;
+  n_lines = unseen = 0;
+  searching = 0;
+  match = -1;
+  back = size;
+  scan_back(at_end ? rows : -1);
+  top = at_end && n_lines > rows ? n_lines - rows : 0;
+  return 1; }
+
+static int segment_cmp (const void *a, const void *b) {
+// Compare segment paths by version order of names sans ".gz".
+  char x[PATH_MAX], y[PATH_MAX], *p;
+  snprintf(x, sizeof(x), "%s", *(char **) a);
+  snprintf(y, sizeof(y), "%s", *(char **) b);
+  if ((p = strrchr(x, '.')) && !strcmp(p, ".gz"))
+    *p = 0;
+  if ((p = strrchr(y, '.')) && !strcmp(p, ".gz"))
+    *p = 0;
+  return strverscmp(x, y); }
+
+static void list_segments () {
+// Read segments of live anew from its directory; keep segment on the same file
+// (or, if it was compressed meanwhile, its gzip'd successor).
+  char dir[PATH_MAX], name[PATH_MAX], *base, *suffix, *shown_path = NULL;
+  struct dirent *e;
+  size_t len;
+  DIR *d;
+  int i;
+  snprintf(dir, sizeof(dir), "%s", live);
+  snprintf(name, sizeof(name), "%s", live);
+  base = basename(name);
+  len = strlen(base);
+  if (segment >= 0)
+    shown_path = segments[segment];
+  for (i = 0; i < n_segments; i++)
+    if (i != segment)
+      free(segments[i]);
+  n_segments = 0;
+  if (!(d = opendir(dirname(dir))))
+    return;
+  while ((e = readdir(d))) {
+    suffix = strrchr(e->d_name, '.');
+    if (strncmp(e->d_name, base, len) || e->d_name[len] != '.' || !e->d_name[len + 1] ||
+        !strcmp(suffix, ".idx") || !strcmp(suffix, ".tmp"))
+      continue;
+    if (!(segments = realloc(segments, (n_segments + 1) * sizeof(char *))) ||
+        !(segments[n_segments] = malloc(strlen(dir) + 1 + strlen(e->d_name) + 1)))
+      fail("plom-ii-view: cannot allocate memory");
+    sprintf(segments[n_segments++], "%s/%s", dir, e->d_name); }
+  closedir(d);
+  qsort(segments, n_segments, sizeof(char *), segment_cmp);
+
+  // Of a segment both plain and gzip'd (while being compressed), keep one.
+  for (i = 1; i < n_segments; i++)
+    if (!segment_cmp(&segments[i - 1], &segments[i])) {
+      free(segments[i]);
+      memmove(segments + i, segments + i + 1, (--n_segments - i) * sizeof(char *)); }
+  if (shown_path) {
+    for (segment = 0; segment < n_segments &&
+                      segment_cmp(&segments[segment], &shown_path) < 0; segment++);
+    free(shown_path); } }
+
+static void show_segment (int older) {
+// Show segment before (if older) or after the one shown, or the live file
+// after the last; show an older one from its end, a newer one from its start.
+  int i;
+  list_segments();
+  i = segment >= 0 ? segment + (older ? -1 : 1) : older ? n_segments - 1 : -1;
+  if (i < 0 && (older || segment < 0)) {
+    snprintf(msg, sizeof(msg), older ? "No older segment" : "No newer segment");
+    return; }
+  path = i < n_segments ? segments[i] : live;
+  if (open_log(older || path == live))
+    segment = i < n_segments ? i : -1;
+  else {
+    snprintf(msg, sizeof(msg), "Cannot open %s", path);
+    path = segment >= 0 ? segments[segment] : live; } }
+
+static void resize () {
+// Get screen size, have all rows redrawn.
+  int y;
+  getmaxyx(stdscr, rows, cols);
+  if (rows < 1)
+    rows = 1;
+  if (!(shown = realloc(shown, (size_t) rows * sizeof(*shown))))
+    fail("plom-ii-view: cannot allocate memory");
+  for (y = 0; y < rows; y++)
+    shown[y].start = -1; }
+
+static void grow (off_t new_size) {
+// Take map[size..new_size) as appended, index only the lines in it. If the
+// screen showed the file end, keep showing it; else count unseen lines.
+  char *p, *end;
+  off_t old = size;
+  size_t old_n = n_lines;
+  int at_end = top + rows >= n_lines;
+  size = new_size;
+  if (!old || map[old - 1] == '\n')
+    append_line(old);
+  for (p = map + old, end = map + size; (p = memchr(p, '\n', end - p)) && p + 1 < end; p++)
+    append_line(p + 1 - map);
+  if (at_end)
+    top = n_lines > rows ? n_lines - rows : 0;
+  else
+    unseen += n_lines - old_n; }
+
+static void follow (off_t new_size) {
+// Map the file grown to new_size beyond its part already mapped, grow().
+  if (new_size > reserved) {
+    open_log(1);
+    return; }
+  if (new_size > file_mapped &&
+      mmap(map + file_mapped, new_size - file_mapped, PROT_READ, MAP_SHARED | MAP_FIXED,
+           fd, file_mapped) == MAP_FAILED)
+    fail("plom-ii-view: cannot map file");
+  if (new_size > file_mapped)
+    file_mapped = (new_size + page - 1) & ~(page - 1);
+  if (file_mapped > backed)
+    backed = file_mapped;
+  if (ring)
+    ring_pos += new_size - size;
+  grow(new_size); }
+
+static void follow_ring () {
+// Copy bytes appended to live since ring_pos from its Ring to map, behind the
+// file's pages (which already hold any appended bytes within them), backing
+// the address space there with anonymous pages as needed; grow() to them. If
+// the Ring was overrun (or an append begun overwriting what was copied), or is
+// of another file, follow() the file.
+  unsigned long long seq = __atomic_load_n(&ring->seq, __ATOMIC_ACQUIRE);
+  off_t new_size = size + (seq - ring_pos), from, len, pos, first;
+  struct stat st;
+  if (path != live || seq <= ring_pos)
+    return;
+  if (ring->ino != ino || seq - ring_pos > ring->size || new_size > reserved) {
+    if (!fstat(fd, &st) && st.st_size > size)
+      follow(st.st_size);
+    return; }
+  if (new_size > backed) {
+    len = (new_size - backed + SCAN_CHUNK - 1) & ~(off_t) (SCAN_CHUNK - 1);
+    len = backed + len > reserved ? reserved - backed : len;
+    if (mmap(map + backed, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      fail("plom-ii-view: cannot allocate memory");
+    backed += len; }
+  from = size > file_mapped ? size : file_mapped;
+  if (from < new_size) {
+    pos = (ring_pos + (from - size)) & (ring->size - 1);
+    len = new_size - from;
+    first = len < ring->size - pos ? len : ring->size - pos;
+    memcpy(map + from, ring->data + pos, first);
+    memcpy(map + from + first, ring->data, len - first);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ring->wseq, __ATOMIC_RELAXED) - ring_pos > ring->size) {
+      if (!fstat(fd, &st) && st.st_size > size)
+        follow(st.st_size);
+      return; } }
+  ring_pos = seq;
+  grow(new_size); }
+
+static void *wait_ring (void *arg) {
+// Thread: write to woken[] whenever the Ring's futex was bumped.
+  unsigned seen = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST), now;
+  for (;;) {
+    __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &ring->futex, FUTEX_WAIT, seen, NULL, NULL, 0);
+    __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    if ((now = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST)) != seen) {
+      seen = now;
+      if (write(woken[1], "", 1) == -1 && errno != EAGAIN)
+        return NULL; } } }
+
+static void attach_ring () {
+// Map plom-ii's Ring for live, if there is one: named by a hash of live's real
+// path. Start thread waiting for appends to it.
+  char real[PATH_MAX], name[32], *p;
+  unsigned long long h = 14695981039346656037ULL;
+  struct stat st;
+  pthread_t thread;
+  Ring *r;
+  int shm;
+  if (!realpath(live, real))
+    return;
+  for (p = real; *p; p++)
+    h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+  snprintf(name, sizeof(name), "/plom-ii-%016llx", h);
+  if ((shm = shm_open(name, O_RDWR, 0)) == -1)
+    return;
+  if (fstat(shm, &st) == -1 || st.st_size < sizeof(Ring) ||
+      (r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0)) == MAP_FAILED) {
+    close(shm);
+    return; }
+  close(shm);
+  if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+      sizeof(Ring) + r->size > st.st_size) {
+    munmap(r, st.st_size);
+    return; }
+  ring = r;
+  if (pipe(woken) == -1 || fcntl(woken[0], F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(woken[1], F_SETFL, O_NONBLOCK) == -1 ||
+      pthread_create(&thread, NULL, wait_ring, NULL))
+    fail("plom-ii-view: cannot wait for shared memory ring"); }
+
+static void redraw_all () {
+// Have all rows redrawn by draw().
+  int y;
+  for (y = 0; y < rows; y++)
+    shown[y].start = -1; }
+
+static off_t find (off_t from, off_t to, off_t *len) {
+// Return offset of first match of pattern in map[from..to), -1 if none; set
+// *len to the match's length. Plain patterns are found with memmem(),
+// vectorized in any decent libc.
+  regmatch_t m;
+  char *p;
+  if (!regex) {
+    if (!(p = memmem(map + from, to - from, pattern, pattern_len)))
+      return -1;
+    *len = pattern_len;
+    return p - map; }
+  m.rm_so = 0;
+  m.rm_eo = to - from;
+  if (regexec(&re, map + from, 1, &m,
+              REG_STARTEND | (from && map[from - 1] != '\n' ? REG_NOTBOL : 0)))
+    return -1;
+  *len = m.rm_eo - m.rm_so;
+  return from + m.rm_so; }
+
+static void status (char *buf) {
+// Describe into buf[] what the status row shows: pattern being typed, message,
+// search progress, or appended lines not yet seen; empty if nothing.
+  buf[0] = 0;
+  if (prompting)
+    snprintf(buf, STATUS_MAX, "%s%c%s", regex ? "regex " : "", prompting, typed);
+  else if (msg[0])
+    snprintf(buf, STATUS_MAX, "%s", msg);
+  else if (searching)
+    snprintf(buf, STATUS_MAX, "-- searching %s%c%s: %d%% --", regex ? "regex " : "",
+             searching > 0 ? '/' : '?', pattern, (int) (searching > 0 ?
+             search_pos * 100 / (size + 1) : (size - search_pos) * 100 / (size + 1)));
+  else if (unseen)
+    snprintf(buf, STATUS_MAX, "-- %zu new line%s below --", unseen, unseen > 1 ? "s" : "");
+  else if (segment >= 0)
+    snprintf(buf, STATUS_MAX, "-- %s (segment %d of %d) --", path, segment + 1, n_segments); }
+
+static void draw () {
+// Show lines from top on, cut to screen width, (re-)drawing only rows whose
+// part of the file changed, highlighting matches of pattern. Lines once
+// written do not change in a log file. Show status in last row, if any.
+  static char shown_status[STATUS_MAX] = "";
+  char now[STATUS_MAX];
+  int y, damaged = 0;
+  size_t i;
+  off_t start, end, full, m, len;
+
+  // Below the screen's end, stop counting unseen lines.
+  if (top + rows >= n_lines)
+    unseen = 0;
+  status(now);
+  if (strcmp(now, shown_status)) {
+    snprintf(shown_status, sizeof(shown_status), "%s", now);
+    shown[rows - 1].start = -1;
+    if (now[0]) {
+      attron(A_REVERSE);
+      mvaddnstr(rows - 1, 0, now, cols);
+      attroff(A_REVERSE);
+      clrtoeol();
+      damaged = 1; } }
+
+  for (y = 0; y < rows - !!now[0]; y++) {
+    i = top + y;
+    start = end = full = 0;
+    if (i < n_lines) {
+      start = lines[head + i];
+      full = i + 1 < n_lines ? lines[head + i + 1] : size;
+      if (full > start && map[full - 1] == '\n')
+        full--;
+      end = full - start > cols ? start + cols : full; }
+    if (shown[y].start == start && shown[y].len == end - start)
+      continue;
+    shown[y].start = start;
+    shown[y].len = end - start;
+    move(y, 0);
+    addnstr(map + start, end - start);
+    clrtoeol();
+    for (m = start; highlight && m < end && (m = find(m, full, &len)) >= 0 && m < end; m++)
+      if (len)
+        mvchgat(y, m - start, m + len > end ? end - m : len, A_REVERSE, 0, NULL);
+    damaged = 1; }
+  if (damaged)
+    refresh(); }
+
+static size_t line_of (off_t off) {
+// Return index of line holding indexed offset off, by binary search.
+  size_t lo = 0, hi = n_lines, mid;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (lines[head + mid] <= off)
+      lo = mid;
+    else
+      hi = mid; }
+  return lo; }
+
+static void found (off_t m, off_t len) {
+// Make m the match, scroll its line into view (indexing lines up to it first).
+  size_t i;
+  match = m;
+  match_len = len;
+  searching = 0;
+  while (back > m)
+    scan_back(1);
+  i = line_of(m);
+  if (i < top || i >= top + rows - 1)
+    top = n_lines > rows && i > n_lines - rows ? n_lines - rows : i; }
+
+static void search_step () {
+// Search next chunk of about SCAN_CHUNK bytes, cut at line ends (so that no
+// match spans chunks): forward from search_pos on, or backward for the last
+// match starting before search_pos. Say so if the file end / start is reached.
+  off_t lo, hi, m, len, last = -1, last_len = 0;
+  char *p;
+  if (searching > 0) {
+    if (search_pos >= size) {
+      snprintf(msg, sizeof(msg), "Pattern not found: %s", pattern);
+      searching = 0;
+      return; }
+    hi = search_pos + SCAN_CHUNK < size ? search_pos + SCAN_CHUNK : size;
+    if (hi < size)
+      hi = (p = memchr(map + hi, '\n', size - hi)) ? p - map + 1 : size;
+    if ((m = find(search_pos, hi, &len)) >= 0)
+      found(m, len);
+    search_pos = hi;
+    return; }
+  if (search_pos <= 0) {
+    snprintf(msg, sizeof(msg), "Pattern not found: %s", pattern);
+    searching = 0;
+    return; }
+  lo = search_pos > SCAN_CHUNK ? search_pos - SCAN_CHUNK : 0;
+  if (lo)
+    lo = (p = memrchr(map, '\n', lo)) ? p - map + 1 : 0;
+  hi = search_pos < size && (p = memchr(map + search_pos, '\n', size - search_pos)) ?
+       p - map : size;
+  for (m = lo; m < hi && (m = find(m, hi, &len)) >= 0 && m < search_pos; m++) {
+    last = m;
+    last_len = len; }
+  if (last >= 0)
+    found(last, last_len);
+  search_pos = lo; }
+
+static int compile () {
+// Compile pattern if regex is set; on failure, say why and return 0.
+  int err;
+  if (compiled)
+    regfree(&re);
+  compiled = 0;
+  if (!regex)
+    return 1;
+  if ((err = regcomp(&re, pattern, REG_EXTENDED | REG_NEWLINE))) {
+    regerror(err, &re, msg, sizeof(msg));
+    return 0; }
+  return compiled = 1; }
+
+static void start_search (int dir) {
+// Search in direction dir from the match, if shown, else from the top line.
+  int shown_match = match >= 0 && match >= lines[head + top] &&
+                    line_of(match) < top + rows;
+  if (!pattern_len) {
+    snprintf(msg, sizeof(msg), "No pattern");
+    return; }
+  redraw_all();
+  if (!(highlight = compile()))
+    return;
+  searching = dir;
+  if (!n_lines)
+    search_pos = dir > 0 ? 0 : size;
+  else if (dir > 0)
+    search_pos = shown_match ? match + 1 : lines[head + top];
+  else
+    search_pos = shown_match ? match : lines[head + top]; }
+
+static void check_file () {
+// Read all pending inotify events. If the file at path grew, follow() it; if
+// it was cut, replaced or (re-)created, open_log() anew. (Gzip'd segments
+// do not change.)
+  char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+  struct stat st;
+  int any = 0;
+  while (read(in_fd, buf, sizeof(buf)) > 0)
+    any = 1;
+  if (!any || inflated || stat(path, &st) == -1 || (st.st_size == size && st.st_ino == ino))
+    return;
+  if (st.st_ino == ino && st.st_size > size)
+    follow(st.st_size);
+  else
+    open_log(1); }
+
+static void prompt_key (int key) {
+// Edit pattern being typed: Enter searches for it (or, if empty, the last one),
+// Escape cancels, Ctrl-R toggles regex.
+  size_t len = strlen(typed);
+  if (key == '\n' || key == KEY_ENTER) {
+    if (len)
+      pattern_len = strlen(strcpy(pattern, typed));
+    start_search(prompting == '/' ? 1 : -1);
+    prompting = 0; }
+  else if (key == 27 || ((key == KEY_BACKSPACE || key == 127 || key == 8) && !len))
+    prompting = 0;
+  else if (key == KEY_BACKSPACE || key == 127 || key == 8)
+    typed[len - 1] = 0;
+  else if (key == 18)
+    regex = !regex;
+  else if (key >= ' ' && key < 256 && len + 1 < sizeof(typed)) {
+    typed[len] = key;
+    typed[len + 1] = 0; } }
+
+static int handle_key (int key) {
+// Act on key; return 0 to quit.
+  msg[0] = 0;
+  if (prompting && key != KEY_RESIZE)
+    prompt_key(key);
+  else if (key == 'q')
+    return 0;
+  else if (key == '/' || key == '?') {
+    prompting = key;
+    typed[0] = 0; }
+  else if (key == 'n' || key == 'N')
+    start_search(key == 'n' ? 1 : -1);
+  else if (key == 27)
+    searching = 0;
+  else if (key == '[' || key == ']')
+    show_segment(key == '[');
+  else if (key == 18) {
+    regex = !regex;
+    redraw_all();
+    highlight = highlight && compile(); }
+  else if (key == KEY_UP) {
+    if (!top)
+      scan_back(1);
+    if (top)
+      top--; }
+  else if (key == KEY_PPAGE) {
+    if (top < rows)
+      scan_back(rows - top);
+    top = top > rows ? top - rows : 0; }
+  else if (key == KEY_DOWN && top + rows < n_lines)
+    top++;
+  else if (key == KEY_NPAGE && top + rows < n_lines)
+    top = top + 2 * rows < n_lines ? top + rows : n_lines - rows;
+  else if (key == KEY_HOME) {
+    scan_back(-1);
+    top = 0; }
+  else if (key == KEY_END)
+    top = n_lines > rows ? n_lines - rows : 0;
+  else if (key == KEY_RESIZE)
+    resize();
+  return 1; }
+
 int main (int argc, char *argv[]) {
 
   // Try to initialize map from command line arguments.
-  FILE * file;
-  if (argc != 2 && argc != 3 ||
+  if ((argc != 2 && argc != 3) ||
       !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
     printf("IRC viewer.\n");
     exit(0); }
-  else if (argc == 2) {
-    file = fopen(argv[1], "r"); }
   else if (argc == 3) {
     printf("In-files not yet implemented.\n");
     exit(0); }
+  path = argv[1];
 
-  // Initialize screen.
+  // Initialize screen; watch file, and its directory for it being re-created.
   WINDOW * screen = initscr();
   curs_set(0);
-  timeout(10);
   keypad(screen, TRUE);
+  nodelay(screen, TRUE);
+  set_escdelay(25);
   noecho();
-  int rows, cols;
-  getmaxyx(screen, rows, cols);
-
-  int y, x, l, key, start = 0;
-  char line[1024], end = 0;
-  struct stat s;
-  stat(argv[1], &s);
-  int mtime = s.st_mtime;
-  while (1) {
-    stat(argv[1], &s);
-
-    fseek(file, start, 0);
-    for (y = 0; y < rows; y++) {
-      if (fgets(line, 1024, file))
-        l = strlen(line);
-      else {
-        l = 0;
-        end = 1; }
-      if (l && y == rows - 1)
-        end = 0;
-      for (x = 0; x < cols; x++)
-        if (x < l)
-          mvaddch(y, x, line[x]);
-        else
-          mvaddch(y, x, ' '); }
-    refresh();
-
-    key = getch();
-
-    if (!key)
-      continue;
-    else if (key == 'q')
-       break;
-
-    else if (key == KEY_UP || key == KEY_PPAGE) {
-      l = 1;
-      for (x = start - 2; ; x--) {
-        if (x <= 0) {
-          start = 0;
-          break; }
-        fseek(file, x, 0);
-        y = (char) fgetc(file);
-        if (y == '\n') {
-          if (key == KEY_UP || l == rows) {
-            start = x + 1;
-            break; }
-          l++; } } }
-
-    else if (key == KEY_DOWN && !end) {
-      fseek(file, start, 0);
-      fgets(line, 1024, file);
-      start = ftell(file); }
-    else if (key == KEY_NPAGE && !end) {
-      l = start;
-      for (x = 0; x < rows; x++) {
-        fseek(file, l, 0);
-        for (y = 0; y < rows; y++) {
-          if (y == 1)
-            l = ftell(file);
-          if (!fgets(line, 1024, file)) {
-            y = 0;
-            break; } }
-        if (!y)
-          break;
-        start = l; } }
-
-    else if (mtime != s.st_mtime) {
-      mtime = s.st_mtime;
-      l = start;
-      for (x = 0; ; x++) {
-        fseek(file, l, 0);
-        for (y = 0; y < rows; y++) {
-          if (y == 1)
-            l = ftell(file);
-          if (!fgets(line, 1024, file)) {
-            y = 0;
-            break; } }
-          if (!y)
-            break;
-          start = l; } } }
+  resize();
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  if ((in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ||
+      inotify_add_watch(in_fd, dirname(dir), IN_CREATE | IN_MOVED_TO) == -1)
+    fail("plom-ii-view: cannot watch file");
+  page = sysconf(_SC_PAGESIZE);
+  live = path;
+  attach_ring();
+  if (!open_log(1))
+    fail("plom-ii-view: cannot open file");
 
-  endwin();
-  exit(0); }
+  // Sleep until keys are typed or the file changes; while searching, or while
+  // the index is incomplete, go on with that chunk by chunk meanwhile.
+  struct pollfd pfd[3] = { { 0, POLLIN, 0 }, { in_fd, POLLIN, 0 },
+                           { ring ? woken[0] : -1, POLLIN, 0 } };
+  char drain[64];
+  int key;
+  while (1) {
+    draw();
+    if (!poll(pfd, 3, searching || back > 0 ? 0 : -1)) {
+      if (searching)
+        search_step();
+      else if (back > 0)
+        scan_back(1); }
+    if (ring && read(woken[0], drain, sizeof(drain)) > 0) {
+      while (read(woken[0], drain, sizeof(drain)) > 0);
+      follow_ring(); }
+    check_file();
+    while ((key = getch()) != ERR)
+      if (!handle_key(key)) {
+        endwin();
+        exit(0); } } }
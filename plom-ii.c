@@ -18,36 +18,329 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <dirent.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef IO_URING
+#include <linux/io_uring.h>
+#endif
 #include <ctype.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #define VERSION "0.2"
 
 #ifndef PIPE_BUF /* FreeBSD don't know PIPE_BUF */
 #define PIPE_BUF 4096
 #endif
+#ifndef F_SETPIPE_SZ /* Linux's, defined only with _GNU_SOURCE */
+#define F_SETPIPE_SZ 1031
+#endif
+#ifndef SYS_close_range /* Linux 5.9 on, for headers older than that */
+#define SYS_close_range 436
+#endif
 #define PING_TIMEOUT 300
+#define PING_INTERVAL 120 /* seconds of server silence before we PING it */
 #define SERVER_PORT 6667
-enum { TOK_START = 0, TOK_CMD, TOK_ARG0, TOK_ARG1, TOK_ARG2, TOK_LAST };
+#define LINEBUF_SIZE (PIPE_BUF * 16) /* bytes read from a descriptor at once */
+#define MAX_EVENTS 64 /* epoll events handled per wakeup */
+#define MAX_OUTFILES 128 /* outfile descriptors kept open at most */
+#define SEGMENTS_PIPE (1024 * 1024) /* bytes of paths queued to compressor */
+#define TIMESTAMP_SIZE 20 /* "%F %T" localtime string plus '\0' */
+#define NAMES_MIN 256 /* initial size of names table, a power of 2 */
+#define ARENA_CHUNK 65536 /* bytes allocated at once for interned names */
+#define POOL_CHUNK 64 /* Channel structs allocated at once */
+#define SENDQ_MIN 4096 /* initial size of send queue ring buffers */
+#define SENDQ_MAX (LINEBUF_SIZE * 4) /* bulk bytes queued before fifos wait */
+#define MAX_PARAMS 15 /* parameters of a server message, RFC 2812 */
+#define CMD_HASH(len, c) (((len) + (c)) & 7) /* perfect for commands[] */
+#define MAX_ADDRS 16 /* resolved addresses of a host tried at most */
+#define MAX_ATTEMPTS 4 /* connect()s to a host's addresses racing at once */
+#define CONNECT_DELAY 250 /* ms before racing next address, RFC 8305 */
+#define RECONNECT_MIN 1 /* seconds before first reconnect, doubled per failure ... */
+#define RECONNECT_MAX 300 /* ... up to this */
+#define MAX_LINE 512 /* bytes of a line to the server, "\r\n" included */
+#define BATCH_SIZE (LINEBUF_SIZE * 16) /* bytes of outfile appends batched */
+#define BATCH_SPANS 4096 /* Spans of those at most */
+#define BATCH_IOVS 1024 /* Spans per writev() (UIO_MAXIOV) */
+#define WRITEQ_MIN (LINEBUF_SIZE * 4) /* bytes of a writer queue at least */
+#ifdef IO_URING
+#define URING_ENTRIES 256 /* submission queue entries of an io_uring */
+#define RECV_BUFS 16 /* buffers provided for multishot recv()s, a power of 2, */
+#define RECV_BUF_SIZE (LINEBUF_SIZE - PIPE_BUF) /* each fitting into read_lines()'
+                                          chunk behind an unfinished line */
+#define APPENDS_SIZE (LINEBUF_SIZE * 16) /* bytes of outfile appends kept */
+#endif
+#define RING_MAGIC 0x706c6f6d /* of an initialized Ring, as in plom-ii-view */
+#define STATS_INTERVAL 10 /* seconds between refreshes of stats files */
+#define STATS_COMMANDS 64 /* slots of a Stats' command counters, a power of 2 */
+#define HIST_SUB_BITS 4 /* log2 of Histogram buckets per power of 2 ... */
+#define HIST_MAX_EXP 40 /* ... of ns up to 2^41 (some 36 minutes) */
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
 
+typedef struct Server Server;
+typedef struct Attempt Attempt;
 typedef struct Channel Channel;
+typedef struct Name Name;
+typedef struct Linebuf Linebuf;
+typedef struct Sendq Sendq;
+typedef struct Slice Slice;
+typedef struct Message Message;
+typedef struct Mark Mark;
+typedef struct Ring Ring;
+typedef struct Stats Stats;
+typedef struct Histogram Histogram;
+typedef struct Span Span;
+typedef struct Record Record;
+typedef struct Writeq Writeq;
+#ifdef IO_URING
+typedef struct Uring Uring;
+typedef struct Append Append;
+#endif
+typedef void (*Handler)(Message *);
+enum { STAGE_WAIT, STAGE_PARSE, STAGE_HANDLE, STAGE_TOTAL, N_STAGES }; /* of a
+  server line: from read() to handling, parse, handler (print_out() batching
+  appends, not writing them; see commits), all */
+enum { CLASS_PRIVMSG, CLASS_JOIN, CLASS_PART, CLASS_NUMERIC, CLASS_OTHER,
+       N_CLASSES }; /* of commands, for latencies */
+enum { SYNC_NONE, SYNC_INTERVAL, SYNC_BATCH }; /* when to fdatasync() outfiles */
+enum { REC_LINES, REC_CLOSE, REC_SYNC, REC_PAD }; /* kinds of Records */
+enum { WATCH_CHANNEL, WATCH_SERVER, WATCH_ATTEMPT, WATCH_RESOLVER, WATCH_QUIT }; /* what an
+                                                   epoll data.ptr points to */
+struct Linebuf {
+  char *part;  /* incomplete last line of previous read, malloc()'d on demand */
+  size_t len;  /* bytes in part[], always < PIPE_BUF */
+  int skip; }; /* discard input until next '\n' (rest of an overlong line) */
+
 struct Channel {
+  int watch;                   /* WATCH_CHANNEL; first, as in Server */
+  Server *srv;
   int fd;
-  char *name;
-  Channel *next; };
+  char *name, *dir, *infile, *outfile, *idxfile; /* interned with name, see Name */
+  int outfd;                   /* O_APPEND outfile descriptor, or -1 */
+  int idxfd;                   /* O_APPEND idxfile descriptor, or -1 */
+  long long outsize, lines;    /* bytes (and, if indexed, lines) of outfile */
+  int outday;                  /* day() of outfile's first line */
+  Ring *ring;                  /* recent outfile lines, shared, or NULL */
+  char ring_name[32];          /* of ring's shared memory object */
+  long long out_lines, fifo_lines; /* counted since channel was added */
+  unsigned long long closing;  /* writeq tail after Record closing its files */
+#ifdef IO_URING
+  int slot;                    /* of outfd in disk's registered files */
+#endif
+  int first_span, last_span;   /* of appends batched for outfile, -1: none */
+  int dirty, unsynced;         /* appended to since last commit / fdatasync() */
+  Channel *dirty_next;         /* chain of dirty channels */
+  long long marked_offset, marked_line; /* last Mark in idxfile, line -1: none */
+  dev_t outdev;                /* identity of the file outfd refers to ... */
+  ino_t outino;
+  time_t outchecked;           /* ... last compared to what outfile path names */
+  Linebuf in;
+  Channel *lru_prev, *lru_next; /* outfiles chain, most recently used first */
+  Channel *next; };             /* chains of dead / free Channel structs */
+
+struct Name {   /* slot in open-addressing table of all names ever used */
+  unsigned hash;
+  char *name;   /* striplower()'d, in arena; NULL: slot unused */
+  char *dir, *infile, *outfile, *idxfile; /* paths of channel's files, in arena */
+  Channel *c; }; /* channel currently using this name, or NULL */
+
+struct Sendq {    /* ring buffer of "\r\n"-terminated lines for the server */
+  char *buf;
+  size_t size;    /* capacity, a power of 2 */
+  size_t head;    /* offset of first queued byte */
+  size_t len;     /* bytes queued */
+  size_t paid;    /* bytes at head already covered by pacing tokens */
+  size_t peak; }; /* most bytes ever queued */
 
-static int irc;
-static time_t last_response;
-static Channel *channels = NULL;
-static char *host = "irc.freenode.net";
-static char nick[32];			/* might change while running */
-static char path[_POSIX_PATH_MAX];
-static char message[PIPE_BUF]; /* message buf used for communication */
+struct Slice {  /* part of a line, not '\0'-terminated */
+  char *s;
+  size_t len; };
+
+struct Message {  /* server line split by parse_message(), nothing copied */
+  Server *srv;
+  char *line;
+  Slice tags, prefix, cmd; /* without leading '@' / ':' */
+  Slice param[MAX_PARAMS]; /* a ":trailing" one without ':' */
+  int nparams; };
+
+struct Mark {       /* entry of a channel's idxfile, in host byte order: */
+  long long offset; /* a line's start in outfile, */
+  long long time;   /* epoch seconds of its timestamp, */
+  long long line; }; /* its number, counting from 0 */
+
+struct Ring {     /* shared memory "/plom-ii-<hash of outfile's real path>" */
+  unsigned magic;   /* RING_MAGIC once initialized */
+  unsigned size;    /* bytes of data[], a power of 2 */
+  unsigned long long seq; /* bytes ever appended, last ones in data[] */
+  unsigned long long wseq; /* seq an append in progress will end at */
+  long long base;   /* seq minus outfile offset of the same byte ... */
+  unsigned long long ino; /* ... in the outfile of this inode */
+  unsigned futex;   /* bumped on each append; waked if there are ... */
+  unsigned waiters; /* ... readers waiting on it */
+  char data[]; };   /* byte seq - 1 is at data[(seq - 1) & (size - 1)] */
+
+struct Record {     /* in a Writeq, followed by len bytes, padded to 8 */
+  Channel *c;
+  long long time;   /* of REC_LINES: when they came in */
+  unsigned len;     /* of REC_LINES: bytes of lines, '\0' included */
+  int kind; };      /* REC_*; REC_PAD (or no room for a Record): skip to end */
+
+struct Writeq {     /* ring of Records from event loop to writer() thread */
+  char *buf;
+  size_t size;      /* bytes of buf, a power of 2; 0: no writer() thread */
+  unsigned long long head, tail; /* bytes ever consumed / produced */
+  unsigned futex;   /* bumped on progress of either side if ... */
+  unsigned waiters; /* ... the other one waits for it */
+  size_t peak;      /* most bytes ever queued */
+  long long stalls; }; /* times the event loop waited for room */
+
+#ifdef IO_URING
+struct Uring {      /* io_uring, its rings mmap()'d */
+  int fd;           /* -1: none */
+  unsigned entries, to_submit; /* of submission queue; queued, not submitted */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes; };
+
+struct Append {     /* bytes to append to an outfile through disk */
+  int slot;         /* index of outfile in disk's registered files */
+  char *buf;        /* in appends[] */
+  unsigned len;
+  int done;         /* written (or failed for good) */
+  Channel *ring;    /* whose Ring to publish all of it to once written, if set */
+  char *start;      /* all of it: start, bytes, outfile offset of its end */
+  unsigned size;
+  long long end; };
+#endif
+
+struct Span {       /* part of batch[] to append to a channel's outfile */
+  char *buf;
+  size_t len;
+  int next; };      /* index of the channel's next Span, -1: none */
+
+struct Histogram {  /* log-linear, of ns: values below 2^HIST_SUB_BITS in */
+  long long count, max; /* buckets of their own, larger ones in 2^HIST_SUB_BITS */
+  long long bucket[HIST_BUCKETS]; }; /* per power of 2, i.e. within 1/16 */
+
+struct Stats {  /* counters of a Server since start, for its stats file */
+  long long lines_in, bytes_in, bytes_out, fifo_lines, print_outs, out_bytes,
+            reconnects;
+  struct { char name[16]; long long n; } commands[STATS_COMMANDS]; /* lines
+           in per command, by hash of name; "*": all others once half full */
+  int n_commands;
+#ifndef NO_LATENCY
+  Histogram read;     /* read() of socket */
+  Histogram latency[N_STAGES][N_CLASSES]; /* of lines, see STAGE_*, CLASS_* */
+#endif
+  };
+
+struct Attempt {  /* connect() in progress to one of a server's addresses */
+  int watch;      /* WATCH_ATTEMPT; first, as in Channel */
+  Server *srv;
+  int fd; };      /* -1: slot unused */
+
+struct Server {  /* connection to one IRC network and its channels */
+  int watch;     /* WATCH_SERVER; first, as in Channel */
+  int irc;       /* -1 while not connected */
+  char *host;
+  unsigned short port;
+  char nick[32];			/* might change while running */
+  char *key, *fullname;
+  char path[_POSIX_PATH_MAX];
+  Linebuf in;
+  Sendq urgent, bulk; /* sent first / paced: pastes, scripted input */
+  double tokens;      /* lines we may send now, refilled by pacing */
+  long long tokens_time; /* ms of last refill */
+  int typed;          /* single fifo lines queued urgent, tokens not yet paid */
+  int fifos_stalled;  /* fifo reading paused: bulk queue full, or not welcomed */
+  int welcomed;       /* 001 received on this connection: fifo lines may go */
+  time_t last_response, last_ping;
+  Name *names;        /* channels by name, linear probing */
+  size_t names_size, names_used;
+  int gai_error;      /* set by resolve() thread, as is ... */
+  struct addrinfo *addrs; /* ... this, until connected */
+  struct addrinfo *addr[MAX_ADDRS]; /* addrs in order to try */
+  int n_addrs, next_addr;
+  long long next_attempt; /* ms when to start connecting to next_addr */
+  Attempt attempts[MAX_ATTEMPTS];
+  int backoff;        /* seconds to wait before next reconnect */
+  long long reconnect_at; /* ms when to look up host again, 0: not waiting */
+  int recv_armed;     /* multishot recv() on irc posted to io_uring, not ended */
+  Stats stats;
+  Server *next; };
+
+static Server *servers = NULL;
+static int resolved[2]; /* pipe of Server *s whose resolve() thread finished */
+static int resolver_watch = WATCH_RESOLVER; /* epoll data.ptr for resolved[0] */
+static int quit_pipe[2]; /* written to by on_quit(), to end run()'s wait */
+static int quit_watch = WATCH_QUIT; /* epoll data.ptr for quit_pipe[0] */
+static int compressor = -1; /* pipe of segments to gzip to compressor child */
+static int pace_burst = 5, pace_ms = 2000; /* token bucket size, ms per token */
+static int index_every = 0; /* Mark lines this many lines / KiB apart, 0: none */
+static long long rotate_size = 0; /* bytes of outfile to rotate at, 0: none */
+static int rotate_daily = 0; /* rotate outfiles at local midnight */
+static unsigned ring_size = 0; /* bytes of each channel's Ring, 0: none */
+static Writeq writeq; /* to writer() thread owning outfiles, if size is set */
+static int sync_policy = SYNC_NONE, sync_interval; /* seconds, if SYNC_INTERVAL */
+static long long next_sync; /* ms when SYNC_INTERVAL fdatasync()s are due */
+static int any_unsynced; /* if outfiles were appended to since fdatasync() */
+static long long out_writes, out_syncs; /* syscalls of these, for stats */
+#ifndef NO_LATENCY
+static Histogram commits; /* commit_outfiles() runs, by whichever thread */
+#endif
+
+// Appends to outfiles, batched in batch[] until commit_outfiles() writes each
+// dirty channel's Spans with one writev().
+static char batch[BATCH_SIZE];
+static size_t batch_len;
+static Span spans[BATCH_SPANS];
+static int n_spans;
+static Channel *dirty = NULL;
+#ifdef IO_URING
+// io_urings: net for multishot recv()s on sockets (into provided buffers
+// recv_bufs) and readiness of epfd, disk for outfile appends. Appends are
+// staged[] in an event loop iteration, then written by one chain of linked
+// writes; the chain in flight is inflight[], its CQEs not yet reaped pending.
+static Uring net = { -1 }, disk = { -1 };
+static struct io_uring_buf_ring *recv_ring;
+static char *recv_bufs;
+static unsigned short recv_tail;
+static int epfd_polled; /* multishot poll of epfd posted to net, not ended */
+static int epfd_more; /* last epoll_wait() may have left events */
+static int recv_multishot = 1; /* unless the kernel lacks it: read via epoll */
+static Append staged[URING_ENTRIES], inflight[URING_ENTRIES];
+static int n_staged, n_inflight, n_pending;
+static char appends[APPENDS_SIZE]; /* bytes of staged, inflight appends */
+static size_t appends_len;
+static char slot_used[MAX_OUTFILES];
+#endif
+static int epfd; /* epoll instance watching all sockets and channel fifos */
+static char *arena = NULL; /* free part of current names arena chunk */
+static size_t arena_left;
+static Channel *pool = NULL; /* free Channel structs */
+static Channel *dead = NULL; /* rm_channel()'d, to be freed after event batch */
+static Channel *outfiles = NULL, *outfiles_last = NULL; /* open outfds, LRU */
+static int outfiles_open;
+static long long wakeups; /* epoll_wait()s returned */
+static time_t started;
+static volatile sig_atomic_t stats_wanted = 0; /* SIGUSR1 received */
+static volatile sig_atomic_t quitting = 0; /* SIGTERM / SIGINT received */
+static long long read_start, read_end; /* ns around read_lines()' last read() */
+static char chunk[LINEBUF_SIZE]; /* of input, for split_lines() */
+static char inlog[LINEBUF_SIZE], insend[LINEBUF_SIZE]; /* batched fifo input */
+static size_t inlog_len, insend_len, inbatch_lines;
 
 static void usage() {
 // Print help message.
@@ -56,8 +349,16 @@ static void usage() {
           "(c)opyright MMV-MMVI Anselm R. Garbe\n"
           "(c)opyright MMV-MMXI Nico Golde\n"
           "(c)opyright MMXII    Christian Heller\n"
-          "usage: ii [-i <irc dir>] [-s <host>] [-p <port>]\n"
-          "          [-n <nick>] [-k <password>] [-f <fullname>]\n");
+          "usage: ii [-i <irc dir>] [-b <burst lines>] [-r <ms per line, 0: no pacing>]\n"
+          "          [-x <lines / KiB between out.idx entries, 0: no out.idx>]\n"
+          "          [-o <MiB per out file, or \"day\": rotate into gzip'd segments>]\n"
+          "          [-m <KiB of recent out lines per channel in shared memory>]\n"
+          "          [-w <KiB of queue to a thread writing out files, 0: no thread>]\n"
+          "          [-y <fdatasync() out files: \"none\", \"batch\" (each write), or every\n"
+          "              <seconds>>]\n"
+          "          [-p <port>] [-n <nick>] [-k <password>] [-f <fullname>]\n"
+          "          [-s <host> [-p <port>] [-n <nick>] [-k <password>] [-f <fullname>]]...\n"
+          "-p, -n, -k, -f before any -s set defaults, after one apply to its host\n");
   exit(EXIT_SUCCESS); }
 
 static char *striplower(char *s) {
@@ -66,12 +367,12 @@ static char *striplower(char *s) {
   for(p = s; p && *p; p++) {
     if(*p == '/')
       *p = ',';
-    *p = tolower(*p); }
+    *p = tolower((unsigned char) *p); }
   return s; }
 
 static void create_dirtree(const char *dir) {
 // Create directories described by "dir" -- top-down, if necessary.
-  char tmp[256];
+  char tmp[PATH_MAX];
   char *p = NULL;
   size_t len;
   snprintf(tmp, sizeof(tmp),"%s",dir);
@@ -85,336 +386,2086 @@ static void create_dirtree(const char *dir) {
       *p = '/'; }
   mkdir(tmp, S_IRWXU); }
 
-static int get_filepath(char *filepath, size_t len, char *channel, char *file) {
-// Build (only dirs) and return filepath: path + (if provided) channel + file.
-  if(channel) {
-    if(!snprintf(filepath, len, "%s/%s", path, channel))
-      return 0;
-    create_dirtree(filepath);
-    return snprintf(filepath, len, "%s/%s/%s", path, channel, file); }
-  return snprintf(filepath, len, "%s/%s", path, file); }
-
-static void create_filepath(char *filepath, size_t len, char *channel, char *suffix) {
-// get_filepath() for file below striplower()'d channel name.
-  if(!get_filepath(filepath, len, striplower(channel), suffix)) {
-    fprintf(stderr, "%s", "plom-ii: path to irc directory too long\n");
+static int open_channel(Channel *c) {
+// Create channel fifo infile, open it / return its file descriptor.
+  if(access(c->infile, F_OK) == -1)
+    mkfifo(c->infile, S_IRWXU);
+  return open(c->infile, O_RDONLY | O_NONBLOCK, 0); }
+
+static char *timestamp(time_t t) {
+// Return "%F %T" localtime string for t, formatted only when t changed.
+  static char buft[TIMESTAMP_SIZE];
+  static time_t last = -1;
+  if(t != last) {
+    strftime(buft, sizeof(buft), "%F %T", localtime(&t));
+    last = t; }
+  return buft; }
+
+static int day(time_t t) {
+// Return number of the local day of t, computed only when t changed.
+  static time_t last = -1;
+  static int d;
+  struct tm tm;
+  if(t != last) {
+    localtime_r(&t, &tm);
+    d = tm.tm_year * 1000 + tm.tm_yday;
+    last = t; }
+  return d; }
+
+static void watch_channel(Channel *c) {
+// Register channel fifo with epoll, edge-triggered: readers must drain it.
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = c;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+    perror("plom-ii: cannot watch channel fifo");
     exit(EXIT_FAILURE); } }
 
-static int open_channel(char *name) {
-// Create channel fifo infile, open it / return its file descriptor.
-  static char infile[256];
-  create_filepath(infile, sizeof(infile), name, "in");
-  if(access(infile, F_OK) == -1)
-    mkfifo(infile, S_IRWXU);
-  return open(infile, O_RDONLY | O_NONBLOCK, 0); }
-
-static void add_channel(char *cname) {
-// If not yet in channels list, add channel to it and create its fifo infile.
+static unsigned hash_name(const char *name) {
+// FNV-1a hash of name[].
+  unsigned h = 2166136261u;
+  for(; *name; name++)
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  return h; }
+
+static Name *find_name(Server *s, const char *name, unsigned hash) {
+// Return slot of name[] in s' names table, or the empty slot it would go into.
+  size_t i, mask = s->names_size - 1;
+  for(i = hash & mask; s->names[i].name; i = (i + 1) & mask)
+    if(s->names[i].hash == hash && !strcmp(s->names[i].name, name))
+      break;
+  return &s->names[i]; }
+
+static Name *intern(Server *s, const char *name) {
+// Return slot of name[] in s' names table, adding it (and its string to arena).
+  unsigned hash = hash_name(name);
+  size_t i, len;
+  char dir[PATH_MAX];
+  Name *n, *old = s->names;
+
+  // Keep table at most half full, grow it by rehashing into twice the size.
+  if(s->names_used >= s->names_size / 2) {
+    s->names_size = s->names_size ? s->names_size * 2 : NAMES_MIN;
+    if(!(s->names = calloc(s->names_size, sizeof(Name)))) {
+      perror("plom-ii: cannot allocate memory");
+      exit(EXIT_FAILURE); }
+    for(i = 0; old && i < s->names_size / 2; i++)
+      if(old[i].name)
+        *find_name(s, old[i].name, old[i].hash) = old[i];
+    free(old); }
+
+  // Add name if not yet known: copy it, the directory path for it (path itself
+  // for the server master channel "") and the paths of its infile, outfile and
+  // idxfile to end of (a new) arena chunk.
+  n = find_name(s, name, hash);
+  if(n->name)
+    return n;
+  if(snprintf(dir, sizeof(dir), name[0] ? "%s/%s" : "%s", s->path, name) >= sizeof(dir)) {
+    fprintf(stderr, "%s", "plom-ii: path to irc directory too long\n");
+    exit(EXIT_FAILURE); }
+  len = strlen(dir);
+  len = strlen(name) + 1 + len + 1 + len + sizeof("/in") + len + sizeof("/out") +
+        len + sizeof("/out.idx");
+  if(len > arena_left) {
+    if(!(arena = malloc(ARENA_CHUNK))) {
+      perror("plom-ii: cannot allocate memory");
+      exit(EXIT_FAILURE); }
+    arena_left = ARENA_CHUNK; }
+  n->name = arena;
+  n->dir = n->name + sprintf(n->name, "%s", name) + 1;
+  n->infile = n->dir + sprintf(n->dir, "%s", dir) + 1;
+  n->outfile = n->infile + sprintf(n->infile, "%s/in", dir) + 1;
+  n->idxfile = n->outfile + sprintf(n->outfile, "%s/out", dir) + 1;
+  sprintf(n->idxfile, "%s/out.idx", dir);
+  n->hash = hash;
+  arena += len;
+  arena_left -= len;
+  s->names_used++;
+  return n; }
+
+static Channel *add_channel(Server *s, char *cname) {
+// If not yet in s' channels table, add channel to it and create its fifo infile.
   Channel *c;
-  int fd;
+  int i;
   char *name = striplower(cname);
 
-  // Abort if channel already in channels[].
-  for(c = channels; c; c = c->next)
-    if(!strcmp(name, c->name))
-      return;
+  // Abort if channel already in channels table.
+  Name *n = intern(s, name);
+  if(n->c)
+    return n->c;
+
+  // Take new Channel struct from pool, refilling it with POOL_CHUNK at once.
+  if(!pool) {
+    if(!(pool = calloc(POOL_CHUNK, sizeof(Channel)))) {
+      perror("plom-ii: cannot allocate memory");
+      exit(EXIT_FAILURE); }
+    for(i = 0; i < POOL_CHUNK - 1; i++)
+      pool[i].next = &pool[i + 1]; }
+  c = pool;
+  pool = c->next;
+  memset(c, 0, sizeof(Channel));
 
-  // Try to create channel fifo infile.
-  fd = open_channel(name);
-  if(fd == -1) {
+  // Populate new channel struct: server, channel name and paths, channel
+  // directory and fifo infile descriptor.
+  c->watch = WATCH_CHANNEL;
+  c->srv = s;
+  c->name = n->name;
+  c->dir = n->dir;
+  c->infile = n->infile;
+  c->outfile = n->outfile;
+  c->idxfile = n->idxfile;
+  c->outfd = c->idxfd = -1;
+  c->first_span = c->last_span = -1;
+  create_dirtree(c->dir);
+  c->fd = open_channel(c);
+  if(c->fd == -1) {
     printf("plom-ii: exiting, cannot create in channel: %s\n", name);
     exit(EXIT_FAILURE); }
+  n->c = c;
+  watch_channel(c);
+  return c; }
 
-  // Allocate memory for new Channel struct.
-  c = calloc(1, sizeof(Channel));
-  if(!c) {
-    perror("plom-ii: cannot allocate memory");
+static void ring_append(Channel *c, const char *buf, size_t len, long long end) {
+// Append len bytes of buf[] (just written to c's outfile, ending at offset
+// end) to c's Ring; then publish them with the new seq, waking waiting readers.
+// The new seq goes to wseq before the copy, for readers to tell which bytes
+// they copied meanwhile may have been overwritten.
+  Ring *r = c->ring;
+  size_t pos, first;
+  unsigned long long seq = r->seq + len;
+  if(len > r->size) {
+    buf += len - r->size;
+    len = r->size; }
+  __atomic_store_n(&r->wseq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  pos = (seq - len) & (r->size - 1);
+  first = len < r->size - pos ? len : r->size - pos;
+  memcpy(r->data + pos, buf, first);
+  memcpy(r->data, buf + first, len - first);
+  r->base = seq - end;
+  r->ino = c->outino;
+  __atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&r->futex, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&r->waiters, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, &r->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0); }
+
+#ifdef IO_URING
+static int uring_setup(Uring *u) {
+// Set up io_uring u, map its rings. Return -1 on failure, or if the kernel
+// lacks features used here.
+  struct io_uring_params p;
+  size_t size;
+  char *ring;
+  memset(&p, 0, sizeof(p));
+  if((u->fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p)) == -1)
+    return -1;
+  size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  if(size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+    size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+     !(p.features & IORING_FEAT_EXT_ARG) ||
+     (ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  u->fd, IORING_OFF_SQ_RING)) == MAP_FAILED ||
+     (u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                     IORING_OFF_SQES)) == MAP_FAILED) {
+    errno = errno ? errno : ENOSYS;
+    close(u->fd);
+    return u->fd = -1; }
+  u->entries = p.sq_entries;
+  u->sq_head = (unsigned *) (ring + p.sq_off.head);
+  u->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+  u->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *) (ring + p.sq_off.array);
+  u->cq_head = (unsigned *) (ring + p.cq_off.head);
+  u->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+  u->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+  return 0; }
+
+static int uring_enter(Uring *u, unsigned wait, void *arg, size_t argsz) {
+// Submit u's queued SQEs; if wait, wait for that many CQEs (with arg, an
+// io_uring_getevents_arg, if set). Return io_uring_enter()'s result.
+  int n = syscall(SYS_io_uring_enter, u->fd, u->to_submit, wait,
+                  (wait ? IORING_ENTER_GETEVENTS : 0) | (arg ? IORING_ENTER_EXT_ARG : 0),
+                  arg, argsz);
+  if(n > 0)
+    u->to_submit -= n;
+  return n; }
+
+static struct io_uring_sqe *uring_sqe(Uring *u) {
+// Queue next SQE of u, return it zeroed for filling in (submitting queued ones
+// first if there is no room).
+  struct io_uring_sqe *sqe;
+  unsigned tail = *u->sq_tail, i;
+  if(u->to_submit == u->entries)
+    uring_enter(u, 0, NULL, 0);
+  i = tail & *u->sq_mask;
+  sqe = &u->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[i] = i;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit++;
+  return sqe; }
+
+static struct io_uring_cqe *uring_cqe(Uring *u) {
+// Return u's next CQE, or NULL if there is none. uring_seen() it after use.
+  unsigned head = *u->cq_head;
+  if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &u->cqes[head & *u->cq_mask]; }
+
+static void uring_seen(Uring *u) {
+// Hand u's CQE returned by uring_cqe() back to the kernel.
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE); }
+
+static void reap_appends(int wait) {
+// Note results of writes in flight; if wait, until all are in. Keep the
+// unwritten rest of short writes (and writes canceled with them) for retrying;
+// publish fully written ones to their channel's Ring.
+  struct io_uring_cqe *cqe;
+  Append *a;
+  while(n_pending) {
+    if(!(cqe = uring_cqe(&disk))) {
+      if(!wait)
+        return;
+      if(uring_enter(&disk, 1, NULL, 0) == -1 && errno != EINTR) {
+        perror("plom-ii: cannot wait for io_uring");
+        exit(EXIT_FAILURE); }
+      continue; }
+    a = &inflight[cqe->user_data];
+    if(cqe->res == (int) a->len) {
+      a->done = 1;
+      if(a->ring && a->ring->ring)
+        ring_append(a->ring, a->start, a->size, a->end); }
+    else if(cqe->res > 0) {
+      a->buf += cqe->res;
+      a->len -= cqe->res; }
+    else if(cqe->res != -ECANCELED) {
+      errno = -cqe->res;
+      perror("plom-ii: cannot write");
+      a->done = 1; }
+    n_pending--;
+    uring_seen(&disk); } }
+
+static void commit_appends() {
+// Wait for the previous chain of writes (usually long done), then write all
+// of its unfinished and then all staged appends, in order, as one new chain.
+  struct io_uring_sqe *sqe;
+  int i, n;
+  reap_appends(1);
+  for(i = n = 0; i < n_inflight; i++)
+    n += !inflight[i].done;
+  if(n) {
+    memmove(staged + n, staged, n_staged * sizeof(Append));
+    for(i = n = 0; i < n_inflight; i++)
+      if(!inflight[i].done)
+        staged[n++] = inflight[i];
+    n_staged += n; }
+  n_inflight = 0;
+  if(!n_staged) {
+    appends_len = 0;
+    return; }
+  for(i = 0; i < n_staged; i++) {
+    sqe = uring_sqe(&disk);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_FIXED_FILE | (i + 1 < n_staged ? IOSQE_IO_LINK : 0);
+    sqe->fd = staged[i].slot;
+    sqe->addr = (unsigned long) staged[i].buf;
+    sqe->len = staged[i].len;
+    sqe->off = -1;
+    sqe->user_data = i; }
+  memcpy(inflight, staged, n_staged * sizeof(Append));
+  n_inflight = n_pending = n_staged;
+  n_staged = 0;
+  if(uring_enter(&disk, 0, NULL, 0) == -1) {
+    perror("plom-ii: cannot submit to io_uring");
+    exit(EXIT_FAILURE); } }
+
+static void flush_appends() {
+// Write all staged appends, wait until they (and those in flight) are done.
+  int i, left;
+  if(disk.fd == -1)
+    return;
+  do {
+    commit_appends();
+    reap_appends(1);
+    for(i = left = 0; i < n_inflight; i++)
+      left += !inflight[i].done; }
+  while(left);
+  n_inflight = 0;
+  appends_len = 0; }
+
+static void stage_append(Channel *c, const char *buf, size_t len) {
+// Stage len bytes of buf[] (to start at c->outsize) for appending to c's outfile
+// at the next commit_appends(); flush_appends() first if out of room.
+  if(n_staged + n_inflight >= URING_ENTRIES || appends_len + len > sizeof(appends))
+    flush_appends();
+  memcpy(appends + appends_len, buf, len);
+  staged[n_staged].slot = c->slot;
+  staged[n_staged].buf = staged[n_staged].start = appends + appends_len;
+  staged[n_staged].len = staged[n_staged].size = len;
+  staged[n_staged].ring = c->ring ? c : NULL;
+  staged[n_staged].end = c->outsize + len;
+  staged[n_staged++].done = 0;
+  appends_len += len; }
+
+static void set_slot(int slot, int fd) {
+// Register fd (-1: none) as disk's file of index slot.
+  struct io_uring_files_update up = { slot, 0, (unsigned long) &fd };
+  if(syscall(SYS_io_uring_register, disk.fd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1) {
+    perror("plom-ii: cannot register file with io_uring");
     exit(EXIT_FAILURE); }
+  slot_used[slot] = fd != -1; }
+#endif
+
+static void writev_all(int fd, struct iovec *iov, int n) {
+// Write n iov[] to fd, continuing after short writes.
+  ssize_t done;
+  while(n > 0) {
+    if((done = writev(fd, iov, n)) < 0) {
+      if(errno == EINTR)
+        continue;
+      perror("plom-ii: cannot write");
+      return; }
+    out_writes++;
+    for(; n > 0 && (size_t) done >= iov->iov_len; iov++, n--)
+      done -= iov->iov_len;
+    if(n > 0) {
+      iov->iov_base = (char *) iov->iov_base + done;
+      iov->iov_len -= done; } } }
+
+#ifndef NO_LATENCY
+static long long now_ns() {
+// Return nanoseconds of monotonic clock.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec; }
+
+static void hist_add(Histogram *h, long long ns) {
+// Count ns in h's bucket for it: below 2^HIST_SUB_BITS its own, else the one of
+// its highest bit's position and the HIST_SUB_BITS bits below that.
+  int e;
+  if(ns < 0)
+    ns = 0;
+  if(ns > h->max)
+    h->max = ns;
+  h->count++;
+  if(ns < 1 << HIST_SUB_BITS) {
+    h->bucket[ns]++;
+    return; }
+  e = 63 - __builtin_clzll(ns);
+  if(e > HIST_MAX_EXP) {
+    h->bucket[HIST_BUCKETS - 1]++;
+    return; }
+  h->bucket[(e - HIST_SUB_BITS + 1) << HIST_SUB_BITS |
+            ((ns >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1))]++; }
+#else
+#define now_ns() 0LL
+#define hist_add(h, ns) ((void) (ns))
+#endif
+
+static void sync_outfiles() {
+// fdatasync() outfiles (and idxfiles) appended to since their last one.
+  Channel *c;
+#ifdef IO_URING
+  flush_appends();
+#endif
+  for(c = outfiles; c; c = c->lru_next)
+    if(c->unsynced) {
+      fdatasync(c->outfd);
+      if(c->idxfd != -1)
+        fdatasync(c->idxfd);
+      out_syncs++;
+      c->unsynced = 0; }
+  any_unsynced = 0; }
+
+static void commit_channel(Channel *c) {
+// Write c's batched appends with one writev() (more if over BATCH_IOVS Spans),
+// only then publish them to its Ring (so readers find them in the outfile).
+  struct iovec iov[BATCH_IOVS];
+  long long end = c->outsize;
+  int i, n;
+  for(i = c->first_span; i != -1; ) {
+    for(n = 0; i != -1 && n < BATCH_IOVS; i = spans[i].next, n++) {
+      iov[n].iov_base = spans[i].buf;
+      iov[n].iov_len = spans[i].len;
+      end -= spans[i].len; }
+    writev_all(c->outfd, iov, n); }
+  for(i = c->first_span; c->ring && i != -1; i = spans[i].next) {
+    end += spans[i].len;
+    ring_append(c, spans[i].buf, spans[i].len, end); }
+  c->first_span = c->last_span = -1;
+  c->dirty = 0;
+  c->unsynced = any_unsynced = sync_policy != SYNC_NONE; }
+
+static void commit_outfiles() {
+// Write batched appends of each dirty channel (see commit_channel(), or through
+// io_uring); with SYNC_BATCH, fdatasync() them. Time that into commits.
+  long long start = dirty ? now_ns() : 0;
+  Channel *c;
+  for(c = dirty; c; c = c->dirty_next)
+    commit_channel(c);
+  dirty = NULL;
+  batch_len = n_spans = 0;
+#ifdef IO_URING
+  if(disk.fd != -1)
+    commit_appends();
+#endif
+  if(sync_policy == SYNC_BATCH && any_unsynced)
+    sync_outfiles();
+  if(start)
+    hist_add(&commits, now_ns() - start); }
 
-  // Prepend new channel struct to channels chain.
-  if(!channels)
-    channels = c;
+static void close_outfile(Channel *c) {
+// Close c's outfile (and idxfile) descriptor, take it out of the outfiles chain.
+// Write its batched appends first (and, unless SYNC_NONE, sync them).
+  Channel **p;
+  if(c->outfd == -1)
+    return;
+  if(c->dirty) {
+    for(p = &dirty; *p != c; p = &(*p)->dirty_next);
+    *p = c->dirty_next;
+    commit_channel(c); }
+#ifdef IO_URING
+  if(disk.fd != -1) {
+    flush_appends();
+    set_slot(c->slot, -1); }
+#endif
+  if(c->unsynced) {
+    fdatasync(c->outfd);
+    if(c->idxfd != -1)
+      fdatasync(c->idxfd);
+    out_syncs++;
+    c->unsynced = 0; }
+  close(c->outfd);
+  c->outfd = -1;
+  if(c->idxfd != -1)
+    close(c->idxfd);
+  c->idxfd = -1;
+  outfiles_open--;
+  if(c->lru_prev)
+    c->lru_prev->lru_next = c->lru_next;
+  else
+    outfiles = c->lru_next;
+  if(c->lru_next)
+    c->lru_next->lru_prev = c->lru_prev;
+  else
+    outfiles_last = c->lru_prev;
+  c->lru_prev = c->lru_next = NULL; }
+
+static void open_index(Channel *c, off_t size) {
+// Open c's idxfile, count lines of outfile (size bytes) on from its last Mark.
+// Start idxfile anew if that Mark does not point to a line start of outfile.
+  static char buf[LINEBUF_SIZE];
+  Mark m = { 0, 0, 0 };
+  struct stat st;
+  ssize_t n;
+  char *p;
+  int fd = open(c->outfile, O_RDONLY | O_CLOEXEC);
+  c->marked_line = -1;
+  c->idxfd = open(c->idxfile, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if(fd == -1 || c->idxfd == -1 || fstat(c->idxfd, &st) == -1) {
+    perror("plom-ii: cannot open index");
+    if(fd != -1)
+      close(fd);
+    if(c->idxfd != -1)
+      close(c->idxfd);
+    c->idxfd = -1;
+    return; }
+  st.st_size -= st.st_size % sizeof(m);
+  if(st.st_size && pread(c->idxfd, &m, sizeof(m), st.st_size - sizeof(m)) == sizeof(m) &&
+     m.offset <= size && m.line >= 0 &&
+     (!m.offset || (pread(fd, buf, 1, m.offset - 1) == 1 && buf[0] == '\n'))) {
+    c->marked_offset = m.offset;
+    c->marked_line = m.line; }
   else {
-    c->next = channels;
-    channels = c; }
+    m.offset = m.line = 0;
+    st.st_size = 0; }
+  if(ftruncate(c->idxfd, st.st_size) == -1)
+    perror("plom-ii: cannot truncate index");
+
+  // Count lines from Mark's (or file's) start on.
+  c->lines = m.line;
+  for(c->outsize = m.offset; c->outsize < size; c->outsize += n) {
+    if((n = pread(fd, buf, sizeof(buf), c->outsize)) <= 0)
+      break;
+    for(p = buf; (p = memchr(p, '\n', buf + n - p)); p++)
+      c->lines++; }
+  c->outsize = size;
+  close(fd); }
+
+static void mark_line(Channel *c, long long offset, time_t t) {
+// Count a line written at offset of c's outfile; Mark it in idxfile if it is
+// index_every lines or KiB past the last Mark.
+  Mark m = { offset, t, c->lines++ };
+  if(c->idxfd == -1 || (c->marked_line >= 0 && m.line - c->marked_line < index_every &&
+                        offset - c->marked_offset < index_every * 1024LL))
+    return;
+  if(write(c->idxfd, &m, sizeof(m)) == sizeof(m)) {
+    c->marked_offset = offset;
+    c->marked_line = m.line; } }
+
+static int open_outfile(Channel *c) {
+// Return descriptor appending to c's outfile, (re-)opening it if not open or
+// if (checked once a second) the file was unlinked or renamed meanwhile.
+// Close least recently used outfiles to stay below MAX_OUTFILES. If indexing,
+// open idxfile along.
+  struct stat st;
+  int retried;
+  time_t now = time(NULL);
+  if(c->outfd != -1 && c->outchecked != now) {
+    c->outchecked = now;
+    if(stat(c->outfile, &st) == -1 || st.st_ino != c->outino || st.st_dev != c->outdev)
+      close_outfile(c); }
+
+  // Already open: move to front of the outfiles chain.
+  if(c->outfd != -1) {
+    if(outfiles != c) {
+      c->lru_prev->lru_next = c->lru_next;
+      if(c->lru_next)
+        c->lru_next->lru_prev = c->lru_prev;
+      else
+        outfiles_last = c->lru_prev;
+      c->lru_prev = NULL;
+      c->lru_next = outfiles;
+      outfiles->lru_prev = c;
+      outfiles = c; }
+    return c->outfd; }
+
+  // Else open it, making room first (and again if running out of descriptors),
+  // re-creating the channel directory if it was removed.
+  if(outfiles_open >= MAX_OUTFILES)
+    close_outfile(outfiles_last);
+  for(retried = 0; (c->outfd = open(c->outfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                                     0666)) == -1; ) {
+    if(errno == EMFILE && outfiles_last)
+      close_outfile(outfiles_last);
+    else if(errno == ENOENT && !retried++)
+      create_dirtree(c->dir);
+    else
+      break; }
+  if(c->outfd == -1 || fstat(c->outfd, &st) == -1) {
+    if(c->outfd != -1)
+      close(c->outfd);
+    return c->outfd = -1; }
+  c->outdev = st.st_dev;
+  c->outino = st.st_ino;
+  c->outsize = st.st_size;
+#ifdef IO_URING
+  if(disk.fd != -1) {
+    for(c->slot = 0; slot_used[c->slot]; c->slot++);
+    set_slot(c->slot, c->outfd); }
+#endif
+  c->outday = day(st.st_size ? st.st_mtime : now);
+  if(index_every)
+    open_index(c, st.st_size);
+  c->outchecked = now;
+  outfiles_open++;
+  c->lru_next = outfiles;
+  if(outfiles)
+    outfiles->lru_prev = c;
+  else
+    outfiles_last = c;
+  outfiles = c;
+  return c->outfd; }
 
-  // Populate new channel struct: channel name, channel fifo descriptor.
-  c->fd = fd;
-  c->name = strdup(name); }
+static void gzip_segment(const char *seg) {
+// gzip file seg to seg.gz (written under a temporary name, so that it appears
+// complete), then remove seg.
+  char buf[LINEBUF_SIZE], gz[PATH_MAX + 8], tmp[PATH_MAX + 8];
+  gzFile out;
+  ssize_t n = 0;
+  int in;
+  snprintf(gz, sizeof(gz), "%s.gz", seg);
+  snprintf(tmp, sizeof(tmp), "%s.gz.tmp", seg);
+  if((in = open(seg, O_RDONLY)) == -1)
+    return;
+  if(!(out = gzopen(tmp, "wb"))) {
+    close(in);
+    return; }
+  while((n = read(in, buf, sizeof(buf))) > 0 && gzwrite(out, buf, n) == n);
+  close(in);
+  if(gzclose(out) != Z_OK || n || rename(tmp, gz) == -1) {
+    unlink(tmp);
+    return; }
+  unlink(seg); }
+
+static void start_compressor() {
+// Fork child process of low priority to gzip_segment() each path (each
+// '\0'-terminated) written to compressor, one after another, until all
+// writers closed it (so queued ones still get done after plom-ii exits).
+  char path[PATH_MAX];
+  int fd[2], c;
+  size_t len = 0;
+  sigset_t none;
+  FILE *in;
+  if(pipe(fd) == -1) {
+    perror("plom-ii: cannot start compressing");
+    return; }
+  fcntl(fd[1], F_SETPIPE_SZ, SEGMENTS_PIPE);
+  switch(fork()) {
+    case -1:
+      perror("plom-ii: cannot start compressing");
+      close(fd[0]);
+      close(fd[1]);
+      return;
+    case 0:
+
+      // Keep no descriptors of the parent's (sockets, fifos) open. Take
+      // signals the default way, unblocked (forked from the writer() thread,
+      // the child would inherit its mask of all blocked).
+      dup2(fd[0], STDIN_FILENO);
+      if(syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0) == -1)
+        for(c = sysconf(_SC_OPEN_MAX) - 1; c > STDERR_FILENO; c--)
+          close(c);
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGUSR1, SIG_DFL);
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, NULL);
+      setpriority(PRIO_PROCESS, 0, 10);
+      if(!(in = fdopen(STDIN_FILENO, "r")))
+        _exit(EXIT_FAILURE);
+      while((c = getc(in)) != EOF)
+        if(c && len < sizeof(path) - 1)
+          path[len++] = c;
+        else if(!c) {
+          path[len] = 0;
+          gzip_segment(path);
+          len = 0; }
+      _exit(EXIT_SUCCESS); }
+  close(fd[0]);
+  fcntl(fd[1], F_SETFL, O_NONBLOCK);
+  fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+  compressor = fd[1]; }
+
+static void compress_segment(const char *seg) {
+// Queue file seg to the compressor child (started at first, or again if it
+// died): one for all segments, so many rotating at once (as with "-o day" at
+// midnight) do not start as many processes. If its queue is full, leave seg.
+  size_t len = strlen(seg) + 1;
+  int tries;
+  for(tries = 0; tries < 2; tries++) {
+    if(compressor == -1)
+      start_compressor();
+    if(compressor == -1 || write(compressor, seg, len) == len)
+      return;
+    if(errno != EPIPE)
+      break;
+    close(compressor);
+    compressor = -1; }
+  fprintf(stderr, "plom-ii: cannot queue %s for compressing: %s\n", seg, strerror(errno)); }
+
+static void rotate_outfile(Channel *c, time_t now) {
+// Rename c's outfile (and idxfile along) to a segment named by time now, then
+// compress it in the background. The next open_outfile() starts a new one.
+  char seg[PATH_MAX], gz[PATH_MAX + 8], idx[PATH_MAX + 8];
+  struct tm tm;
+  size_t len;
+  int i;
+  localtime_r(&now, &tm);
+  len = snprintf(seg, sizeof(seg), "%s.", c->outfile);
+  len += strftime(seg + len, sizeof(seg) - len, "%Y%m%d-%H%M%S", &tm);
+  for(i = 1; ; i++) {
+    snprintf(gz, sizeof(gz), "%s.gz", seg);
+    if(access(seg, F_OK) && access(gz, F_OK))
+      break;
+    snprintf(seg + len, sizeof(seg) - len, "-%d", i); }
+  close_outfile(c);
+  if(rename(c->outfile, seg) == -1) {
+    perror("plom-ii: cannot rotate outfile");
+    return; }
+  snprintf(idx, sizeof(idx), "%s.idx", seg);
+  rename(c->idxfile, idx);
+  compress_segment(seg); }
+
+static void open_ring(Channel *c) {
+// Map c's Ring, named by a hash of its outfile's real path (which readers can
+// compute), creating and initializing it unless it exists with ring_size.
+  char path[PATH_MAX], *name = c->ring_name;
+  unsigned long long h = 14695981039346656037ULL;
+  struct stat st;
+  Ring *r;
+  char *p;
+  int fd;
+  if(!realpath(c->outfile, path))
+    return;
+  for(p = path; *p; p++)
+    h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+  snprintf(name, sizeof(c->ring_name), "/plom-ii-%016llx", h);
+  if((fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1 ||
+     fstat(fd, &st) == -1 ||
+     (st.st_size != sizeof(Ring) + ring_size &&
+      ftruncate(fd, sizeof(Ring) + ring_size) == -1) ||
+     (r = mmap(NULL, sizeof(Ring) + ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0)) == MAP_FAILED) {
+    perror("plom-ii: cannot set up shared memory ring");
+    if(fd != -1)
+      close(fd);
+    return; }
+  close(fd);
+  if(r->magic != RING_MAGIC || r->size != ring_size) {
+    r->magic = 0;
+    r->size = ring_size;
+    r->seq = r->wseq = r->base = r->ino = 0;
+    __atomic_store_n(&r->magic, RING_MAGIC, __ATOMIC_RELEASE); }
+  c->ring = r; }
+
+static void close_files(Channel *c) {
+// Close c's outfile (and idxfile), unmap and remove its Ring (readers that
+// mapped it keep it until they let go).
+  close_outfile(c);
+  if(c->ring) {
+    munmap(c->ring, sizeof(Ring) + c->ring->size);
+    shm_unlink(c->ring_name); }
+  c->ring = NULL; }
+
+static void unlink_rings() {
+// Remove all channels' Rings, to not leave their memory taken after exit.
+  Server *s;
+  size_t i;
+  for(s = servers; s; s = s->next)
+    for(i = 0; i < s->names_size; i++)
+      if(s->names[i].c && s->names[i].c->ring)
+        shm_unlink(s->names[i].c->ring_name); }
+
+static void writeq_progress() {
+// Tell the other side of writeq that head / tail moved, if it waits for that.
+  if(__atomic_load_n(&writeq.waiters, __ATOMIC_SEQ_CST)) {
+    __atomic_add_fetch(&writeq.futex, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &writeq.futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0); } }
+
+static void writeq_sleep(unsigned long long *pos, unsigned long long old) {
+// Sleep until writeq's head / tail at pos moved on from old, or maybe
+// spuriously (as on a signal): callers check again.
+  unsigned f = __atomic_load_n(&writeq.futex, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&writeq.waiters, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(pos, __ATOMIC_SEQ_CST) == old)
+    syscall(SYS_futex, &writeq.futex, FUTEX_WAIT_PRIVATE, f, NULL, NULL, 0);
+  __atomic_sub_fetch(&writeq.waiters, 1, __ATOMIC_SEQ_CST); }
+
+static void writeq_put(Channel *c, long long t, int kind, const char *buf,
+                       unsigned len) {
+// Append Record of kind for c (lines of len bytes at buf[], come in at t) to
+// writeq; if there is no room, wait for writer() to make some. (writer() is
+// only woken then, else once per batch of events by run(), to save syscalls.)
+// If asked to quit meanwhile, writer() is stuck: exit, leaving writeq unwritten.
+  size_t need = (sizeof(Record) + len + 7) & ~7;
+  size_t pos = writeq.tail & (writeq.size - 1), skip = 0;
+  unsigned long long head;
+  Record *r;
+  if(writeq.size - pos < need)
+    skip = writeq.size - pos;
+  while(writeq.tail + skip + need - (head = __atomic_load_n(&writeq.head,
+                                     __ATOMIC_ACQUIRE)) > writeq.size) {
+    if(quitting) {
+      fprintf(stderr, "plom-ii: writer thread stuck, exiting with queued lines unwritten\n");
+      exit(EXIT_FAILURE); }
+    writeq.stalls++;
+    writeq_progress();
+    writeq_sleep(&writeq.head, head); }
+  if(skip >= sizeof(Record))
+    ((Record *) (writeq.buf + pos))->kind = REC_PAD;
+  r = (Record *) (writeq.buf + ((pos + skip) & (writeq.size - 1)));
+  r->c = c;
+  r->time = t;
+  r->len = len;
+  r->kind = kind;
+  memcpy(r + 1, buf, len);
+  __atomic_store_n(&writeq.tail, writeq.tail + skip + need, __ATOMIC_SEQ_CST);
+  if(writeq.tail - head > writeq.peak)
+    writeq.peak = writeq.tail - head; }
 
 static void rm_channel(Channel *c) {
-// Remove Channel *c from channels chain.
-  Channel *p;
-  if(channels == c)
-    channels = channels->next;
+// Remove Channel *c from channels table, close its fifo (and, through the
+// writer() thread if there is one, its outfile). As events for it may still be
+// pending in the current epoll batch, or Records in writeq, only free it in
+// free_dead().
+  find_name(c->srv, c->name, hash_name(c->name))->c = NULL;
+  if(c->fd != -1) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1; }
+  if(writeq.size) {
+    writeq_put(c, 0, REC_CLOSE, NULL, 0);
+    c->closing = writeq.tail; }
+  else
+    close_files(c);
+  c->next = dead;
+  dead = c; }
+
+static void free_dead() {
+// Return channels removed by rm_channel() to pool, once writer() is through
+// with them. (Their names stay interned.)
+  Channel *c, **p = &dead;
+  unsigned long long head = __atomic_load_n(&writeq.head, __ATOMIC_ACQUIRE);
+  while((c = *p)) {
+    if(c->closing > head) {
+      p = &c->next;
+      continue; }
+    *p = c->next;
+    free(c->in.part);
+    c->next = pool;
+    pool = c; } }
+
+static long long now_ms() {
+// Return milliseconds of monotonic clock.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000; }
+
+#ifndef NO_LATENCY
+static long long hist_at(Histogram *h, double q) {
+// Return upper bound of the bucket holding h's q quantile (at most h's max).
+  long long n = 0, upper = 0;
+  int i, e;
+  for(i = 0; i < HIST_BUCKETS && n < q * h->count; i++) {
+    n += h->bucket[i];
+    if(i < 1 << HIST_SUB_BITS)
+      upper = i;
+    else {
+      e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+      upper = ((long long) ((1 << HIST_SUB_BITS) + (i & ((1 << HIST_SUB_BITS) - 1)) + 1)
+               << (e - HIST_SUB_BITS)) - 1; } }
+  return upper < h->max ? upper : h->max; }
+
+static void write_hist(FILE *f, const char *stage, const char *class, Histogram *h) {
+// Write "latency <stage> <class> <count> <p50> <p90> <p99> <p99.9> <max>" (ns)
+// line for h to f, unless h is empty.
+  if(h->count)
+    fprintf(f, "latency %s %s %lld %lld %lld %lld %lld %lld\n", stage, class,
+            h->count, hist_at(h, .5), hist_at(h, .9), hist_at(h, .99),
+            hist_at(h, .999), h->max); }
+
+static void write_latencies(FILE *f, Stats *st) {
+// Write lines of st's non-empty histograms to f: socket read()s, writes of
+// batched appends (of all servers, copied from the writer() thread's if any),
+// then stages of lines by class of command.
+  static char *stages[N_STAGES] = { "wait", "parse", "handle", "total" };
+  static char *classes[N_CLASSES] = { "PRIVMSG", "JOIN", "PART", "numeric", "other" };
+  Histogram commit;
+  int i, j;
+  commit.count = __atomic_load_n(&commits.count, __ATOMIC_RELAXED);
+  commit.max = __atomic_load_n(&commits.max, __ATOMIC_RELAXED);
+  for(i = 0; i < HIST_BUCKETS; i++)
+    commit.bucket[i] = __atomic_load_n(&commits.bucket[i], __ATOMIC_RELAXED);
+  write_hist(f, "read", "-", &st->read);
+  write_hist(f, "commit", "-", &commit);
+  for(i = 0; i < N_STAGES; i++)
+    for(j = 0; j < N_CLASSES; j++)
+      write_hist(f, stages[i], classes[j], &st->latency[i][j]); }
+
+static int command_class(Slice *cmd) {
+// Return CLASS_* of command cmd.
+  if(cmd->len == 3 && isdigit((unsigned char) cmd->s[0]))
+    return CLASS_NUMERIC;
+  if(cmd->len == 7 && !strncmp(cmd->s, "PRIVMSG", 7))
+    return CLASS_PRIVMSG;
+  if(cmd->len == 4 && !strncmp(cmd->s, "JOIN", 4))
+    return CLASS_JOIN;
+  if(cmd->len == 4 && !strncmp(cmd->s, "PART", 4))
+    return CLASS_PART;
+  return CLASS_OTHER; }
+
+static void take_times(Server *s, Slice *cmd, long long start, long long parsed) {
+// Count in s' latencies of cmd's class the stages of a line from the last
+// read() on, its handling having started at start, its parsing ended at parsed.
+  Histogram *h = &s->stats.latency[0][command_class(cmd)];
+  long long done = now_ns();
+  hist_add(h + STAGE_WAIT * N_CLASSES, start - read_end);
+  hist_add(h + STAGE_PARSE * N_CLASSES, parsed - start);
+  hist_add(h + STAGE_HANDLE * N_CLASSES, done - parsed);
+  hist_add(h + STAGE_TOTAL * N_CLASSES, done - read_end); }
+#else
+#define take_times(s, cmd, start, parsed) ((void) (start), (void) (parsed))
+#define write_latencies(f, st)
+#endif
+
+static void sendq_add(Sendq *q, const char *buf, size_t len) {
+// Append len bytes of buf[] to q, doubling its ring buffer if too small.
+  size_t size, pos, first;
+  char *new;
+  for(size = q->size ? q->size : SENDQ_MIN; size - q->len < len; size *= 2);
+  if(size != q->size) {
+    if(!(new = malloc(size))) {
+      perror("plom-ii: cannot allocate memory");
+      exit(EXIT_FAILURE); }
+    first = q->len < q->size - q->head ? q->len : q->size - q->head;
+    memcpy(new, q->buf + q->head, first);
+    memcpy(new + first, q->buf, q->len - first);
+    free(q->buf);
+    q->buf = new;
+    q->size = size;
+    q->head = 0; }
+  pos = (q->head + q->len) & (q->size - 1);
+  first = len < q->size - pos ? len : q->size - pos;
+  memcpy(q->buf + pos, buf, first);
+  memcpy(q->buf, buf + first, len - first);
+  q->len += len;
+  if(q->len > q->peak)
+    q->peak = q->len; }
+
+static size_t sendq_pay(Server *s, Sendq *q, int force) {
+// Pay one of s' tokens for each complete line following the paid bytes at q's
+// head while tokens last (if force, for all, maybe overdrawing); return paid bytes.
+  size_t pos, seg;
+  char *nl;
+  while(q->paid < q->len && (force || !pace_ms || s->tokens >= 1)) {
+    pos = (q->head + q->paid) & (q->size - 1);
+    seg = q->len - q->paid < q->size - pos ? q->len - q->paid : q->size - pos;
+    if((nl = memchr(q->buf + pos, '\n', seg))) {
+      q->paid += nl - (q->buf + pos) + 1;
+      if(pace_ms)
+        s->tokens--; }
+    else
+      q->paid += seg; }
+  return q->paid; }
+
+static int sendq_iov(Sendq *q, size_t len, struct iovec *iov) {
+// Describe first len bytes of q in (up to two) iov[], return their number.
+  size_t first = len < q->size - q->head ? len : q->size - q->head;
+  if(!len)
+    return 0;
+  iov[0].iov_base = q->buf + q->head;
+  iov[0].iov_len = first;
+  if(first == len)
+    return 1;
+  iov[1].iov_base = q->buf;
+  iov[1].iov_len = len - first;
+  return 2; }
+
+static size_t sendq_drop(Sendq *q, size_t len) {
+// Remove up to len sent bytes from q's head, return number removed.
+  if(len > q->paid)
+    len = q->paid;
+  q->head = (q->head + len) & (q->size - 1);
+  q->len -= len;
+  q->paid -= len;
+  return len; }
+
+static int flush_sendq(Server *s) {
+// Send s' urgent queue and of its bulk queue what pacing allows, all with one
+// writev(). Return ms until bulk queue may send more, or -1 if not waiting.
+  struct iovec iov[4];
+  int n_iov;
+  ssize_t n;
+  long long now = now_ms();
+  if(s->irc == -1)
+    return -1;
+
+  // Refill token bucket according to time passed since last refill.
+  if(pace_ms) {
+    s->tokens += (double) (now - s->tokens_time) / pace_ms;
+    if(s->tokens > pace_burst)
+      s->tokens = pace_burst; }
+  s->tokens_time = now;
+
+  // Write, remove written bytes from queues, urgent first.
+  n_iov = sendq_iov(&s->urgent, sendq_pay(s, &s->urgent, 1), iov);
+  s->typed = 0;
+  n_iov += sendq_iov(&s->bulk, sendq_pay(s, &s->bulk, 0), iov + n_iov);
+  if(n_iov) {
+    n = writev(s->irc, iov, n_iov);
+    if(n > 0)
+      s->stats.bytes_out += n;
+    if(n > 0)
+      sendq_drop(&s->bulk, n - sendq_drop(&s->urgent, n));
+    else if(n < 0 && errno != EAGAIN && errno != EINTR)
+      perror("plom-ii: cannot write to socket"); }
+  if(s->bulk.paid == s->bulk.len)
+    return -1;
+  return (1 - s->tokens) * pace_ms + 1; }
+
+static void append_out(Channel *c, const char *buf, size_t len) {
+// Batch len bytes of buf[] (starting at c->outsize) for c's outfile, to be
+// written by the next commit_outfiles() (done early if the batch is full);
+// extend c's last Span if they follow it in batch[]. Or stage them if appends
+// go through io_uring. Either way, they go to c's Ring once written.
+  Span *last = c->last_span != -1 ? &spans[c->last_span] : NULL;
+  if(!c->dirty) {
+    c->dirty = 1;
+    c->dirty_next = dirty;
+    dirty = c; }
+#ifdef IO_URING
+  if(disk.fd != -1) {
+    stage_append(c, buf, len);
+    return; }
+#endif
+  if(batch_len + len > sizeof(batch) || n_spans == BATCH_SPANS) {
+    commit_outfiles();
+    append_out(c, buf, len);
+    return; }
+  memcpy(batch + batch_len, buf, len);
+  if(last && last->buf + last->len == batch + batch_len)
+    last->len += len;
   else {
-    for(p = channels; p && p->next != c; p = p->next);
-    if(p->next == c)
-      p->next = c->next; }
-  free(c->name);
-  free(c); }
+    spans[n_spans].buf = batch + batch_len;
+    spans[n_spans].len = len;
+    spans[n_spans].next = -1;
+    if(last)
+      last->next = n_spans;
+    else
+      c->first_span = n_spans;
+    c->last_span = n_spans++; }
+  batch_len += len; }
+
+static void write_out(Channel *c, time_t now, char *buf) {
+// Append each line of buf[] (come in at now) to c's outfile, prefixed with
+// localtime string; rotate that first if it is full or of an earlier day.
+  static char out[LINEBUF_SIZE];
+  char *p, *nl, *buft = timestamp(now);
+  size_t len = 0, l;
+  int fd;
+
+  // Get descriptor appending to c's outfile.
+  if((fd = open_outfile(c)) == -1)
+    return;
+  if(ring_size && !c->ring)
+    open_ring(c);
+  if(c->outsize && ((rotate_size && c->outsize >= rotate_size) ||
+                    (rotate_daily && c->outday != day(now)))) {
+    rotate_outfile(c, now);
+    if((fd = open_outfile(c)) == -1)
+      return; }
+
+  // Collect buf[] line by line, prefixed with localtime string; write at once.
+  for(p = buf; p; p = nl ? nl + 1 : NULL) {
+    nl = strchr(p, '\n');
+    l = nl ? (size_t) (nl - p) : strlen(p);
+    if(len + TIMESTAMP_SIZE + l + 1 > sizeof(out)) {
+      append_out(c, out, len);
+      c->outsize += len;
+      c->srv->stats.out_bytes += len;
+      len = 0; }
+    if(index_every)
+      mark_line(c, c->outsize + len, now);
+    len += sprintf(out + len, "%s %.*s\n", buft, (int) l, p);
+    c->out_lines++; }
+  append_out(c, out, len);
+  c->outsize += len;
+  c->srv->stats.out_bytes += len; }
+
+static void start_thread(void *(*run)(void *), void *arg, const char *error) {
+// Start detached thread run(arg) with all signals blocked (so they interrupt
+// the event loop's waits, not its); on failure, perror() error and exit.
+  pthread_t thread;
+  pthread_attr_t attr;
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if(pthread_create(&thread, &attr, run, arg)) {
+    perror(error);
+    exit(EXIT_FAILURE); }
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL); }
+
+static void *writer(void *arg) {
+// Thread: write_out() lines of Records in writeq, close files of removed
+// channels, one Record after another; sleep while there are none.
+  unsigned long long head = 0;
+  size_t pos;
+  Record *r;
+  for(;;) {
+    if(__atomic_load_n(&writeq.tail, __ATOMIC_ACQUIRE) == head) {
+      writeq_sleep(&writeq.tail, head);
+      continue; }
+    pos = head & (writeq.size - 1);
+    r = (Record *) (writeq.buf + pos);
+    if(writeq.size - pos < sizeof(Record) || r->kind == REC_PAD)
+      head += writeq.size - pos;
+    else {
+      if(r->kind == REC_LINES)
+        write_out(r->c, r->time, (char *) (r + 1));
+      else if(r->kind == REC_SYNC) {
+        commit_outfiles();
+        sync_outfiles(); }
+      else
+        close_files(r->c);
+      head += (sizeof(Record) + r->len + 7) & ~7; }
+
+    // Write out batched appends before catching up with tail (so that what
+    // drain_writer() waits for is written).
+    if(head == __atomic_load_n(&writeq.tail, __ATOMIC_ACQUIRE))
+      commit_outfiles();
+    __atomic_store_n(&writeq.head, head, __ATOMIC_SEQ_CST);
+    writeq_progress(); }
+  return NULL; }
+
+static void start_writer() {
+// Set up writeq of writeq.size bytes, start writer() thread to empty it.
+  if(!(writeq.buf = malloc(writeq.size))) {
+    perror("plom-ii: cannot allocate memory");
+    exit(EXIT_FAILURE); }
+  start_thread(writer, NULL, "plom-ii: cannot start writer thread"); }
 
-static void login(char *key, char *fullname) {
+static void drain_writer() {
+// Wait until writer() has handled all of writeq.
+  unsigned long long head;
+  writeq_progress();
+  while((head = __atomic_load_n(&writeq.head, __ATOMIC_SEQ_CST)) != writeq.tail)
+    writeq_sleep(&writeq.head, head); }
+
+static Channel *print_out(Server *s, char *channel, char *buf) {
+// Append each line of buf[] to appropriate out file of s (see write_out()),
+// or have the writer() thread do so if there is one. Return channel written to.
+  Channel *c = add_channel(s, channel ? channel : "");
+  s->stats.print_outs++;
+  if(writeq.size)
+    writeq_put(c, time(NULL), REC_LINES, buf, strlen(buf) + 1);
+  else
+    write_out(c, time(NULL), buf);
+  return c; }
+
+static void login(Server *s) {
 // Write login info into server socket.
-  if(key)
+  char message[PIPE_BUF];
+  if(s->key)
     snprintf(message, PIPE_BUF,
              "PASS %s\r\nNICK %s\r\nUSER %s localhost %s :%s\r\n",
-             key, nick, nick, host, fullname ? fullname : nick);
+             s->key, s->nick, s->nick, s->host, s->fullname ? s->fullname : s->nick);
   else
     snprintf(message, PIPE_BUF,
              "NICK %s\r\nUSER %s localhost %s :%s\r\n",
-              nick, nick, host, fullname ? fullname : nick);
-  write(irc, message, strlen(message));	}
+              s->nick, s->nick, s->host, s->fullname ? s->fullname : s->nick);
+  sendq_add(&s->urgent, message, strlen(message)); }
 
-static int tcpopen(unsigned short port) {
-// Build socket file connection to host:port, return file descriptor.
-  int fd;
-  struct sockaddr_in sin;
-  memset(&sin, 0, sizeof(struct sockaddr_in));
+static void *resolve(void *arg) {
+// Thread: look up addresses of Server *arg, then send arg through resolved[].
+  Server *s = arg;
+  char port[8];
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%u", s->port);
+  s->gai_error = getaddrinfo(s->host, port, &hints, &s->addrs);
+  write(resolved[1], &s, sizeof(s));
+  return NULL; }
 
-  // Write host address into sin.
-  struct hostent *hp = gethostbyname(host);
-  if(!hp) {
-    perror("plom-ii: cannot retrieve host information");
-    exit(EXIT_FAILURE); }
-  memcpy(&sin.sin_addr, hp->h_addr, hp->h_length);
+static void start_resolve(Server *s) {
+// Resolve s' host in a detached thread, so as not to block the event loop.
+  start_thread(resolve, s, "plom-ii: cannot start resolver thread"); }
 
-  sin.sin_family = AF_INET;
-  sin.sin_port = htons(port);
+static void schedule_reconnect(Server *s, const char *why) {
+// Log why s is not connected, look up its host again after backoff seconds
+// (randomized by up to half, so many clients do not return all at once).
+// Until then, there are no addresses left to try (s->addrs is freed, or is
+// the resolver thread's to fill).
+  char msg[PIPE_BUF];
+  int ms = s->backoff * 500 + rand() % (s->backoff * 500 + 1);
+  s->n_addrs = s->next_addr = 0;
+  snprintf(msg, sizeof(msg), "-!- plom-ii: %s, reconnecting in %d.%03d s", why,
+           ms / 1000, ms % 1000);
+  fprintf(stderr, "plom-ii: %s: %s\n", s->host, msg + strlen("-!- plom-ii: "));
+  print_out(s, NULL, msg);
+  s->stats.reconnects++;
+  s->reconnect_at = now_ms() + ms;
+  s->backoff = s->backoff * 2 > RECONNECT_MAX ? RECONNECT_MAX : s->backoff * 2; }
 
-  // Build/connect socket.
-  if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("plom-ii: cannot create socket");
-    exit(EXIT_FAILURE); }
-  if(connect(fd, (const struct sockaddr *) &sin, sizeof(sin)) < 0) {
-    perror("plom-ii: cannot connect to host");
+static void drop_connection(Server *s, const char *why) {
+// Close s' socket (canceling its recv() in io_uring), forget unsent lines and
+// unread rest of server output, then schedule_reconnect(). Channel fifos stay
+// open.
+#ifdef IO_URING
+  struct io_uring_sqe *sqe;
+  if(s->recv_armed) {
+    sqe = uring_sqe(&net);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) s;
+    sqe->user_data = 1; }
+#endif
+  epoll_ctl(epfd, EPOLL_CTL_DEL, s->irc, NULL);
+  close(s->irc);
+  s->irc = -1;
+  s->in.len = s->in.skip = 0;
+  s->urgent.head = s->urgent.len = s->urgent.paid = 0;
+  s->bulk.head = s->bulk.len = s->bulk.paid = 0;
+  s->typed = s->welcomed = 0;
+  schedule_reconnect(s, why); }
+
+#ifdef IO_URING
+static void arm_recv(Server *s) {
+// Post multishot recv() on s' socket to net, into buffers of recv_ring.
+  struct io_uring_sqe *sqe = uring_sqe(&net);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->fd = s->irc;
+  sqe->user_data = (unsigned long) s;
+  s->recv_armed = 1; }
+#endif
+
+static void connected(Server *s, int fd) {
+// Make fd s' socket; give up other connect() attempts, watch fd with epoll
+// (only for writability if io_uring receives from it), queue login.
+  int i, events = EPOLLIN | EPOLLOUT | EPOLLET;
+  for(i = 0; i < MAX_ATTEMPTS; i++)
+    if(s->attempts[i].fd != -1 && s->attempts[i].fd != fd)
+      close(s->attempts[i].fd);
+  for(i = 0; i < MAX_ATTEMPTS; i++)
+    s->attempts[i].fd = -1;
+  freeaddrinfo(s->addrs);
+  s->addrs = NULL;
+  s->n_addrs = s->next_addr = 0;
+  s->irc = fd;
+  s->last_response = s->last_ping = time(NULL);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#ifdef IO_URING
+  if(net.fd != -1 && recv_multishot)
+    events = EPOLLOUT | EPOLLET;
+#endif
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &(struct epoll_event) { events, { s } }) == -1) {
+    perror("plom-ii: cannot watch socket");
     exit(EXIT_FAILURE); }
-  return fd; }
+#ifdef IO_URING
+  if(net.fd != -1 && recv_multishot && !s->recv_armed)
+    arm_recv(s);
+#endif
+  login(s); }
 
-static size_t tokenize(char **result, size_t reslen, char *str, char delim) {
-// In str[], replace delim with \0, store pointers of first reslen chunks in result[], return chunks number.
-  char *p = NULL, *n = NULL;
-  size_t i;
-  if(!str)
-    return 0;
+static void start_attempt(Server *s) {
+// Start non-blocking connect() to next address of s in a free attempts slot.
+// If that fails at once, go on with the next one; if none are left, retry later.
+  Attempt *a = NULL;
+  struct addrinfo *ai;
+  int i;
+  for(i = 0; i < MAX_ATTEMPTS && !a; i++)
+    if(s->attempts[i].fd == -1)
+      a = &s->attempts[i];
+  while(a && s->next_addr < s->n_addrs) {
+    ai = s->addr[s->next_addr++];
+    s->next_attempt = now_ms() + CONNECT_DELAY;
+    a->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                   ai->ai_protocol);
+    if(a->fd == -1)
+      continue;
+    if(!connect(a->fd, ai->ai_addr, ai->ai_addrlen)) {
+      connected(s, a->fd);
+      return; }
+    if(errno == EINPROGRESS &&
+       epoll_ctl(epfd, EPOLL_CTL_ADD, a->fd,
+                 &(struct epoll_event) { EPOLLOUT | EPOLLET, { a } }) != -1)
+      return;
+    close(a->fd);
+    a->fd = -1; }
+  for(i = 0; i < MAX_ATTEMPTS; i++)
+    if(s->attempts[i].fd != -1)
+      return;
+  if(s->next_addr == s->n_addrs) {
+    freeaddrinfo(s->addrs);
+    s->addrs = NULL;
+    s->n_addrs = s->next_addr = 0;
+    schedule_reconnect(s, "cannot connect to host"); } }
 
-  // Move pointer to first non-whitespace in str[].
-  for(n = str; *n == ' '; n++);
-
-  // Replace delim chars, save chunk pointers in result[].
-  p = n;
-  for(i = 0; *n != 0;) {
-    if(i == reslen)
-      return 0;
-    if(*n == delim) {
-      *n = 0;
-      result[i++] = p;
-      p = ++n; }
-    else
-      n++; }
-
-  // Add last chunk pointer to result[], if a valid one.
-  if(i<reslen && p<n && strlen(p))
-    result[i++] = p;
-  return i; }
-
-static void print_out(char *channel, char *buf) {
-// Append buf[] to appropriate out file, prefixed with localtime string.
-  static char outfile[256], server[256], buft[20];
-  FILE *out = NULL;
-  time_t t = time(0);
-
-  // Create (if non-existant), open outfile.
-  create_filepath(outfile, sizeof(outfile), channel, "out");
-  if(!(out = fopen(outfile, "a")))
+static void handle_attempt(Attempt *a) {
+// Check connect() of a: if it succeeded, a wins the race; if it failed, try
+// next address at once.
+  int err = 0;
+  socklen_t len = sizeof(err);
+  struct sockaddr_storage peer;
+  if(a->fd == -1)
     return;
+  getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  len = sizeof(peer);
+  if(!err && !getpeername(a->fd, (struct sockaddr *) &peer, &len))
+    connected(a->srv, a->fd);
+  else if(err) {
+    close(a->fd);
+    a->fd = -1;
+    start_attempt(a->srv); } }
 
-  // Only add channel if channel[] is set /appropriately/.
-  if(channel && channel[0])
-    add_channel(channel);
+static void handle_resolved() {
+// For each server whose addresses were looked up, order them alternating
+// between address families, the first one as getaddrinfo() put it first
+// (RFC 8305), and start connecting. If lookup failed, retry later.
+  char why[PIPE_BUF];
+  Server *s;
+  struct addrinfo *ai, *other;
+  int family;
+  while(read(resolved[0], &s, sizeof(s)) == sizeof(s)) {
+    if(s->gai_error) {
+      snprintf(why, sizeof(why), "cannot retrieve host information: %s",
+               gai_strerror(s->gai_error));
+      schedule_reconnect(s, why);
+      continue; }
+    family = s->addrs->ai_family;
+    ai = s->addrs;
+    for(other = s->addrs; other && other->ai_family == family; other = other->ai_next);
+    for(s->n_addrs = 0; (ai || other) && s->n_addrs < MAX_ADDRS; ) {
+      if(ai) {
+        s->addr[s->n_addrs++] = ai;
+        for(ai = ai->ai_next; ai && ai->ai_family != family; ai = ai->ai_next); }
+      if(other && s->n_addrs < MAX_ADDRS) {
+        s->addr[s->n_addrs++] = other;
+        for(other = other->ai_next; other && other->ai_family == family;
+            other = other->ai_next); } }
+    s->next_addr = 0;
+    start_attempt(s); } }
 
-  // Finish by printing out buf[], prefixed with localtime string.
-  strftime(buft, sizeof(buft), "%F %T", localtime(&t));
-  fprintf(out, "%s %s\n", buft, buf);
-  fclose(out); }
+static void split_lines(Linebuf *lb, size_t n, void (*handle)(char *, void *),
+                        void *arg) {
+// Hand each complete line in chunk[] (lb's partial line plus n bytes read
+// behind it) and arg to handle(), keep the rest in lb.
+// Lines are '\0'-terminated without "\r\n"; lines longer than PIPE_BUF - 1
+// are cut to that length and their remainder is dropped.
+  char *p, *nl, *end = chunk + lb->len + n;
+  lb->len = 0;
 
-static int read_line(int fd, size_t res_len, char *buf) {
-// Read into buf[] one line, up to size res_len. End line with '\0'.
-  size_t i = 0;
-  char c = 0;
-  do {
-    if(read(fd, &c, sizeof(char)) != sizeof(char))
-      return -1;
-    buf[i++] = c;
-  } while(c != '\n' && i < res_len);
-  buf[i - 1] = 0;
-  return 0; }
+  // Find line ends with memchr() (word-/vector-wise in any decent libc).
+  for(p = chunk; (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+    if(lb->skip) {
+      lb->skip = 0;
+      continue; }
+    if(nl > p && nl[-1] == '\r')
+      nl[-1] = 0;
+    *nl = 0;
+    if(nl - p > PIPE_BUF - 1)
+      p[PIPE_BUF - 1] = 0;
+    handle(p, arg); }
+
+  // Keep unterminated rest for next read; if too long already, cut it now.
+  if(p == end || lb->skip)
+    return;
+  if(end - p >= PIPE_BUF - 1) {
+    p[PIPE_BUF - 1] = 0;
+    handle(p, arg);
+    lb->skip = 1;
+    return; }
+  if(!lb->part && !(lb->part = malloc(PIPE_BUF))) {
+    perror("plom-ii: cannot allocate memory");
+    exit(EXIT_FAILURE); }
+  lb->len = end - p;
+  memcpy(lb->part, p, lb->len); }
+
+static ssize_t read_lines(int fd, Linebuf *lb, void (*handle)(char *, void *),
+                          void *arg) {
+// Read chunk from fd, split_lines() it. Return read()'s result.
+  ssize_t n;
+
+  // Continue the partial line left over from the previous read, if any.
+  memcpy(chunk, lb->part, lb->len);
+  read_start = now_ns();
+  n = read(fd, chunk + lb->len, sizeof(chunk) - lb->len);
+  read_end = now_ns();
+  if(n > 0)
+    split_lines(lb, n, handle, arg);
+  return n; }
+
+static void flush_channels_input(Server *s) {
+// Write batched fifo input lines to s' server outfile and send queue, all at
+// once. A single line read from a fifo is taken to be typed by a user and sent
+// before any queued multi-line batch (paste, script output) -- but only while
+// a pacing token is left for it, so scripts writing a line at a time are
+// paced like any other batch.
+  double tokens = s->tokens - s->typed;
+  if(inlog_len) {
+    inlog[inlog_len - 1] = 0;
+    print_out(s, 0, inlog); }
+  if(pace_ms) {
+    tokens += (double) (now_ms() - s->tokens_time) / pace_ms;
+    if(tokens > pace_burst - s->typed)
+      tokens = pace_burst - s->typed; }
+  if(insend_len && inbatch_lines == 1 && (!pace_ms || tokens >= 1)) {
+    sendq_add(&s->urgent, insend, insend_len);
+    s->typed++; }
+  else if(insend_len)
+    sendq_add(&s->bulk, insend, insend_len);
+  inlog_len = insend_len = 0; }
+
+static void proc_channels_input(char *buf, void *arg) {
+// Add line from fifo of Channel *arg to batch for outfile ("> " prefixed) and
+// socket. Queue PONG replies as urgent right away.
+  static char pong[PIPE_BUF + 2];
+  Server *s = ((Channel *) arg)->srv;
+  size_t len = strlen(buf);
+  if(inlog_len + len + 3 > sizeof(inlog) || insend_len + len + 2 > sizeof(insend))
+    flush_channels_input(s);
+  inlog_len += sprintf(inlog + inlog_len, "> %s\n", buf);
+  inbatch_lines++;
+  s->stats.fifo_lines++;
+  ((Channel *) arg)->fifo_lines++;
+  if(!strncasecmp(buf, "PONG", 4) && (buf[4] == ' ' || !buf[4]))
+    sendq_add(&s->urgent, pong, sprintf(pong, "%s\r\n", buf));
+  else
+    insend_len += sprintf(insend + insend_len, "%s\r\n", buf); }
 
 static void handle_channels_input(Channel *c) {
-// Try to read line from fifo, process.
-  static char buf[PIPE_BUF];
+// Read all available fifo input (while bulk send queue has room), process it as
+// one batch. Leave it unread until s is registered (001 received), so it is
+// neither sent ahead of login nor refused before registration.
+  Server *s = c->srv;
+  ssize_t n = 1;
+  if(!s->welcomed) {
+    s->fifos_stalled = 1;
+    return; }
+  inbatch_lines = 0;
+  while(s->bulk.len < SENDQ_MAX && (n = read_lines(c->fd, &c->in, proc_channels_input, c)) > 0);
+  if(n > 0) {
+    s->fifos_stalled = 1;
+    flush_channels_input(s);
+    return; }
 
-  // If channel fifo reading fails, try to re-open fifo before removing channel.
-  if(read_line(c->fd, PIPE_BUF, buf) == -1) {
+  // If all writers closed the fifo (or reading failed), process any unfinished
+  // line and re-open it; if that fails, remove channel.
+  if(n == 0 || errno != EAGAIN) {
+    if(c->in.len && !c->in.skip) {
+      c->in.part[c->in.len] = 0;
+      proc_channels_input(c->in.part, c); }
+    c->in.len = c->in.skip = 0;
+    flush_channels_input(s);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
     close(c->fd);
-    int fd = open_channel(c->name);
-    if(fd != -1)
-      c->fd = fd;
+    c->fd = open_channel(c);
+    if(c->fd != -1)
+      watch_channel(c);
     else
       rm_channel(c);
     return; }
+  flush_channels_input(s); }
 
-  // Translate buf[] into message to channel/user, write to outfile and socket.
-  snprintf(message, PIPE_BUF, "> %s", buf);
-  print_out(0, message);
-  snprintf(message, PIPE_BUF, "%s\r\n", buf);
-  write(irc, message, strlen(message)); }
+static char *skip_word(char *p) {
+// Return pointer to first ' ' or '\0' from p on.
+  while(*p && *p != ' ')
+    p++;
+  return p; }
 
-static void handle_server_output() {
-// Interpret line from server; write message to appropriate outfile.
-  char *argv[TOK_LAST], *p, buf[PIPE_BUF];
+static void parse_message(Server *s, char *line, Message *m) {
+// Point m's slices into line[] (from s) as [@tags] [:prefix] command params [:trailing].
+  char *p = line;
+  m->srv = s;
+  m->line = line;
+  m->tags.len = m->prefix.len = 0;
+  m->nparams = 0;
+  while(*p == ' ')
+    p++;
+  if(*p == '@') {
+    m->tags.s = ++p;
+    p = skip_word(p);
+    m->tags.len = p - m->tags.s;
+    while(*p == ' ')
+      p++; }
+  if(*p == ':') {
+    m->prefix.s = ++p;
+    p = skip_word(p);
+    m->prefix.len = p - m->prefix.s;
+    while(*p == ' ')
+      p++; }
+  m->cmd.s = p;
+  p = skip_word(p);
+  m->cmd.len = p - m->cmd.s;
 
-  // Try to read line from socket.
-  if(read_line(irc, PIPE_BUF, buf) == -1) {
-    perror("plom-ii: remote host closed connection");
-    exit(EXIT_FAILURE); }
-
-  // Replace '\r' with '\0'.
-  for(p = buf; p && *p != 0; p++)
-    if(*p == '\r') {
-      *p = 0;
+  // Last possible parameter takes rest of line, like a ":trailing" one does.
+  while(m->nparams < MAX_PARAMS) {
+    while(*p == ' ')
+      p++;
+    if(!*p)
+      break;
+    if(*p == ':' || m->nparams == MAX_PARAMS - 1) {
+      p += *p == ':';
+      m->param[m->nparams].s = p;
+      m->param[m->nparams++].len = strlen(p);
       break; }
+    m->param[m->nparams].s = p;
+    p = skip_word(p);
+    m->param[m->nparams].len = p - m->param[m->nparams].s;
+    m->nparams++; } }
+
+static Channel *print_to(Message *m, Slice *name) {
+// print_out() m's line to channel of name, or, if that is unset / empty, server.
+  char channel[PIPE_BUF];
+  if(!name || !name->len)
+    return print_out(m->srv, 0, m->line);
+  memcpy(channel, name->s, name->len);
+  channel[name->len] = 0;
+  return print_out(m->srv, channel, m->line); }
+
+static Slice *param(Message *m, int i) {
+// Return m's parameter i, NULL if there is none.
+  return i < m->nparams ? &m->param[i] : NULL; }
+
+static void on_part(Message *m) {
+// For PART, *first* print message, *then* remove channel from channel table and delete its infile.
+  Channel *c = print_to(m, param(m, 0));
+  if(c->name[0]) {
+    unlink(c->infile);
+    rm_channel(c); } }
+
+static void on_privmsg(Message *m) {
+// For PRIVMSG queries, the outfile channel name is the sender's nick from prefix.
+  Slice *target = param(m, 0), from = m->prefix;
+  char *nick = m->srv->nick;
+  if(target && target->len == strlen(nick) && !memcmp(target->s, nick, target->len)) {
+    for(from.len = 0; from.len < m->prefix.len && from.s[from.len] != '!'; from.len++);
+    target = &from; }
+  print_to(m, target); }
 
-  // Copy unmodified string into message[] -- to be used by print_out().
+static void on_join(Message *m) {
+  print_to(m, param(m, 0)); }
+
+static void on_param1(Message *m) {
+  print_to(m, param(m, 1)); }
+
+static void on_param2(Message *m) {
+  print_to(m, param(m, 2)); }
+
+static void rejoin(Server *s) {
+// Queue JOINs of all of s' channels (names starting like channels do, not
+// queries or the server's), as many as fit into each line of MAX_LINE bytes.
+  char line[MAX_LINE], *p;
+  size_t i, len = 0, l;
+  Name *n;
+  for(i = 0; i < s->names_size; i++) {
+    n = &s->names[i];
+    if(!n->c || !n->name[0] || !strchr("#&+!", n->name[0]))
+      continue;
+    l = strlen(n->name);
+    if(len && len + 1 + l + 2 > sizeof(line)) {
+      memcpy(line + len, "\r\n", 2);
+      sendq_add(&s->bulk, line, len + 2);
+      len = 0; }
+    if(!len && sizeof("JOIN \r\n") - 1 + l > sizeof(line))
+      continue;
+    len += sprintf(line + len, len ? "," : "JOIN ");
+    for(p = n->name; *p; p++)
+      line[len++] = *p == ',' ? '/' : *p; }
+  if(len) {
+    memcpy(line + len, "\r\n", 2);
+    sendq_add(&s->bulk, line, len + 2); } }
+
+static void on_welcome(Message *m) {
+// Registration succeeded: reset reconnect backoff, rejoin channels; have the
+// event loop resume_fifos() left unread until now.
+  print_to(m, NULL);
+  m->srv->backoff = RECONNECT_MIN;
+  m->srv->welcomed = 1;
+  rejoin(m->srv); }
+
+// Handlers of messages to channel/user outfiles; messages of any other command
+// go to the server outfile. Numeric replies are looked up by their number, named
+// commands by CMD_HASH() of their length and first char.
+static Handler numerics[1000] = {
+  [1] = on_welcome, [332] = on_param1, [333] = on_param1, [353] = on_param2, [366] = on_param1 };
+static struct { char *name; Handler handler; } commands[8] = {
+  [CMD_HASH(4, 'P')] = { "PART", on_part },
+  [CMD_HASH(7, 'P')] = { "PRIVMSG", on_privmsg },
+  [CMD_HASH(4, 'J')] = { "JOIN", on_join } };
+
+static Handler find_handler(Slice *cmd) {
+// Return handler of command cmd, or NULL if it has none.
   int i;
-  for(i = 0; i < PIPE_BUF; i++) {
-    message[i] = buf[i];
-    if (buf[i] == 0)
-      break; }
+  if(cmd->len == 3 && isdigit((unsigned char) cmd->s[0]) &&
+     isdigit((unsigned char) cmd->s[1]) && isdigit((unsigned char) cmd->s[2]))
+    return numerics[(cmd->s[0] - '0') * 100 + (cmd->s[1] - '0') * 10 + cmd->s[2] - '0'];
+  if(!cmd->len)
+    return NULL;
+  i = CMD_HASH(cmd->len, cmd->s[0]);
+  if(commands[i].name && !strncmp(commands[i].name, cmd->s, cmd->len) &&
+     !commands[i].name[cmd->len])
+    return commands[i].handler;
+  return NULL; }
 
-  // In TOK_CMD, save chunks separated by ' ' as tokens TOK_START, TOK_CMD, TOK_ARG{0,1,2}.
-  tokenize(&argv[TOK_START], TOK_LAST - TOK_START, buf, ' ');
+static void count_command(Stats *st, Slice *cmd) {
+// Count a line of command cmd in st. Once half of st's command slots are used,
+// count lines of commands without one as lines of "*".
+  static Slice none = { "-", 1 }, other = { "*", 1 };
+  unsigned h;
+  size_t i, len;
+  st->lines_in++;
+  if(!cmd->len)
+    cmd = &none;
+  for(;;) {
+    len = cmd->len < sizeof(st->commands[0].name) ? cmd->len :
+          sizeof(st->commands[0].name) - 1;
+    for(h = 0, i = 0; i < len; i++)
+      h = h * 31 + (unsigned char) cmd->s[i];
+    for(i = h & (STATS_COMMANDS - 1); st->commands[i].name[0];
+        i = (i + 1) & (STATS_COMMANDS - 1))
+      if(!strncmp(st->commands[i].name, cmd->s, len) && !st->commands[i].name[len]) {
+        st->commands[i].n++;
+        return; }
+    if(st->n_commands < STATS_COMMANDS / 2 || cmd == &other)
+      break;
+    cmd = &other; }
+  memcpy(st->commands[i].name, cmd->s, len);
+  st->commands[i].n = 1;
+  st->n_commands++; }
 
-  // For PART, *first* print message, *then* remove channel from channel chain and delete its infile.
-  if (!strncmp(argv[TOK_CMD], "PART", 4)) {
-    Channel *c;
-    char infile[256];
-    print_out(argv[TOK_ARG0], message);
-    for(c = channels; c; c = c->next)
-      if(!strcmp(argv[TOK_ARG0], c->name))
-        break;
-    rm_channel(c);
-    snprintf(infile, 256, "%s/%s/in", path, argv[TOK_ARG0]);
-    unlink(infile); }
-
-  // For PRIVMSG queries, the outfile channel name is taken from TOK_START.
-  else if (!strncmp(argv[TOK_CMD], "PRIVMSG", 7))
-    if (!strncmp(argv[TOK_ARG0], nick, sizeof(nick))) {
-      for(p = argv[TOK_START]; *p; p++)
-        if(*p == '!') {
-          *p = 0;
-          break; } 
-      print_out(argv[TOK_START] + 1, message); }
-    else
-      print_out(argv[TOK_ARG0], message);
-
-  // Write message to channel/user outfile for appropriate commands, else to server outfile.
-  else if (!strncmp(argv[TOK_CMD], "JOIN", 4))
-    print_out(argv[TOK_ARG0], message);
-  else if (!strncmp(argv[TOK_CMD], "332", 3) ||
-           !strncmp(argv[TOK_CMD], "333", 3) ||
-           !strncmp(argv[TOK_CMD], "366", 3))
-    print_out(argv[TOK_ARG1], message);
-  else if (!strncmp(argv[TOK_CMD], "353", 3))
-    print_out(argv[TOK_ARG2], message);
+static void proc_server_cmd(char *buf, void *arg) {
+// Interpret line from Server *arg; write message to appropriate outfile.
+  Message m;
+  Handler handler;
+  char *p;
+  long long start = now_ns(), parsed;
+
+  // Cut line at first '\r'.
+  if((p = strchr(buf, '\r')))
+    *p = 0;
+
+  parse_message(arg, buf, &m);
+  count_command(&((Server *) arg)->stats, &m.cmd);
+  handler = find_handler(&m.cmd);
+  parsed = now_ns();
+  if(handler)
+    handler(&m);
+  else
+    print_out(arg, 0, buf);
+  take_times(arg, &m.cmd, start, parsed); }
+
+static void handle_server_output(Server *s) {
+// Read all available output of server s, interpret every complete line in it.
+// Drop the connection if the server closed it or reading failed.
+  char why[PIPE_BUF];
+  ssize_t n;
+  while((n = read_lines(s->irc, &s->in, proc_server_cmd, s)) > 0) {
+    s->stats.bytes_in += n;
+    hist_add(&s->stats.read, read_end - read_start); }
+  if(n == 0)
+    drop_connection(s, "remote host closed connection");
+  else if(errno != EAGAIN) {
+    snprintf(why, sizeof(why), "cannot read from remote host: %s", strerror(errno));
+    drop_connection(s, why); } }
+
+#ifdef IO_URING
+static void handle_recv(struct io_uring_cqe *cqe) {
+// Interpret every complete line received for a Server by multishot recv(),
+// give its buffer back. Once the recv() ended: if the server closed the
+// connection or receiving failed, drop it; if the kernel lacks multishot
+// recv() (before Linux 6.0), read the socket (and later ones) through epoll;
+// else (out of buffers, or canceled with an earlier connection) post a new one.
+  Server *s = (Server *) (unsigned long) cqe->user_data;
+  struct io_uring_buf *b;
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  char why[PIPE_BUF];
+  if(cqe->flags & IORING_CQE_F_BUFFER) {
+    if(cqe->res > 0 && s->irc != -1) {
+      memcpy(chunk, s->in.part, s->in.len);
+      memcpy(chunk + s->in.len, recv_bufs + bid * RECV_BUF_SIZE, cqe->res);
+      read_start = read_end = now_ns();
+      split_lines(&s->in, cqe->res, proc_server_cmd, s);
+      s->stats.bytes_in += cqe->res;
+      s->last_response = time(NULL); }
+    b = &recv_ring->bufs[recv_tail & (RECV_BUFS - 1)];
+    b->addr = (unsigned long) (recv_bufs + bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&recv_ring->tail, ++recv_tail, __ATOMIC_RELEASE); }
+  if(cqe->flags & IORING_CQE_F_MORE)
+    return;
+  s->recv_armed = 0;
+  if(s->irc == -1)
+    return;
+  if(cqe->res == -EINVAL) {
+    recv_multishot = 0;
+    if(epoll_ctl(epfd, EPOLL_CTL_MOD, s->irc,
+                 &(struct epoll_event) { EPOLLIN | EPOLLOUT | EPOLLET, { s } }) == -1) {
+      perror("plom-ii: cannot watch socket");
+      exit(EXIT_FAILURE); } }
+  else if(cqe->res == 0)
+    drop_connection(s, "remote host closed connection");
+  else if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+    snprintf(why, sizeof(why), "cannot read from remote host: %s", strerror(-cqe->res));
+    drop_connection(s, why); }
   else
-    print_out(0, message); }
+    arm_recv(s); }
+
+static int uring_wait(struct epoll_event *ev, int timeout, sigset_t *mask) {
+// Like epoll_pwait(), but wait in net: commit appends, submit queued SQEs,
+// sleep until CQEs come (unless epfd was left with events ready); handle
+// received data, then take what events epfd has ready.
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct __kernel_timespec ts = { timeout / 1000, timeout % 1000 * 1000000LL };
+  struct io_uring_getevents_arg arg = { (unsigned long) mask, _NSIG / 8, 0,
+                                        (unsigned long) &ts };
+  if(!epfd_polled) {
+    sqe = uring_sqe(&net);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = epfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    epfd_polled = 1; }
+  if(uring_enter(&net, !epfd_more && !uring_cqe(&net), &arg, sizeof(arg)) == -1 &&
+     errno != ETIME)
+    return -1;
+  while((cqe = uring_cqe(&net))) {
+    if(!cqe->user_data && !(cqe->flags & IORING_CQE_F_MORE))
+      epfd_polled = 0;
+    else if(cqe->user_data > 1)
+      handle_recv(cqe);
+    uring_seen(&net); }
+  timeout = epoll_wait(epfd, ev, MAX_EVENTS, 0);
+  epfd_more = timeout == MAX_EVENTS;
+  return timeout; }
+
+static void start_uring() {
+// Set up net with recv_ring of RECV_BUFS buffers and, if outfiles are not left
+// to a writer() thread, disk with room for MAX_OUTFILES registered files. If
+// either fails, go on without it.
+  struct io_uring_buf_reg reg;
+  int fds[MAX_OUTFILES], i;
+  memset(&reg, 0, sizeof(reg));
+  if(uring_setup(&net) == -1 ||
+     (recv_ring = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ |
+                       PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED ||
+     !(recv_bufs = malloc(RECV_BUFS * RECV_BUF_SIZE)) ||
+     (reg.ring_addr = (unsigned long) recv_ring, reg.ring_entries = RECV_BUFS,
+      syscall(SYS_io_uring_register, net.fd, IORING_REGISTER_PBUF_RING, &reg, 1))) {
+    perror("plom-ii: cannot set up io_uring, using epoll");
+    if(net.fd != -1)
+      close(net.fd);
+    net.fd = -1;
+    return; }
+  for(i = 0; i < RECV_BUFS; i++) {
+    recv_ring->bufs[i].addr = (unsigned long) (recv_bufs + i * RECV_BUF_SIZE);
+    recv_ring->bufs[i].len = RECV_BUF_SIZE;
+    recv_ring->bufs[i].bid = i; }
+  __atomic_store_n(&recv_ring->tail, recv_tail = RECV_BUFS, __ATOMIC_RELEASE);
+  if(writeq.size)
+    return;
+  for(i = 0; i < MAX_OUTFILES; i++)
+    fds[i] = -1;
+  if(uring_setup(&disk) == -1 ||
+     syscall(SYS_io_uring_register, disk.fd, IORING_REGISTER_FILES, fds, MAX_OUTFILES)) {
+    perror("plom-ii: cannot set up io_uring for out files, writing directly");
+    if(disk.fd != -1)
+      close(disk.fd);
+    disk.fd = -1; } }
+#endif
+
+static void resume_fifos(Server *s) {
+// Read fifos of s left unread while its bulk queue was full or it was not
+// registered.
+  size_t i;
+  s->fifos_stalled = 0;
+  for(i = 0; i < s->names_size; i++)
+    if(s->names[i].c && s->names[i].c->fd != -1)
+      handle_channels_input(s->names[i].c); }
+
+static void write_stats(Server *s) {
+// Write counters of s and of the process into s' stats file, one "<name>
+// <value>" per line ("command <name> <lines>" and "channel <name> <out lines>
+// <fifo lines> <out file bytes>" ones for each; the server's own named "-"),
+// then latencies (see write_hist()). Write to a temporary file first, so
+// readers find only complete ones.
+  char path[PATH_MAX + 8], tmp[PATH_MAX + 8];
+  Stats *st = &s->stats;
+  Channel *c;
+  size_t i;
+  int channels = 0;
+  FILE *f;
+  snprintf(path, sizeof(path), "%s/stats", s->path);
+  snprintf(tmp, sizeof(tmp), "%s/stats.tmp", s->path);
+  if(!(f = fopen(tmp, "w"))) {
+    perror("plom-ii: cannot write stats file");
+    return; }
+  for(i = 0; i < s->names_size; i++)
+    channels += s->names[i].c != NULL;
+  fprintf(f, "pid %d\nuptime %lld\nwakeups %lld\noutfiles_open %d\n"
+          "out_writes %lld\nout_syncs %lld\n",
+          (int) getpid(), (long long) (time(NULL) - started), wakeups,
+          __atomic_load_n(&outfiles_open, __ATOMIC_RELAXED),
+          __atomic_load_n(&out_writes, __ATOMIC_RELAXED),
+          __atomic_load_n(&out_syncs, __ATOMIC_RELAXED));
+  fprintf(f, "connected %d\nreconnects %lld\nlines_in %lld\nbytes_in %lld\n"
+          "bytes_out %lld\nfifo_lines %lld\nprint_outs %lld\nout_bytes %lld\n"
+          "channels %d\n", s->irc != -1, st->reconnects, st->lines_in, st->bytes_in,
+          st->bytes_out, st->fifo_lines, st->print_outs,
+          __atomic_load_n(&st->out_bytes, __ATOMIC_RELAXED), channels);
+  if(writeq.size)
+    fprintf(f, "writer_queue %llu\nwriter_queue_peak %zu\nwriter_stalls %lld\n",
+            writeq.tail - __atomic_load_n(&writeq.head, __ATOMIC_RELAXED),
+            writeq.peak, writeq.stalls);
+  fprintf(f, "urgent_queue %zu\nurgent_queue_peak %zu\nbulk_queue %zu\n"
+          "bulk_queue_peak %zu\nfifos_stalled %d\n", s->urgent.len, s->urgent.peak,
+          s->bulk.len, s->bulk.peak, s->fifos_stalled);
+  for(i = 0; i < STATS_COMMANDS; i++)
+    if(st->commands[i].name[0])
+      fprintf(f, "command %s %lld\n", st->commands[i].name, st->commands[i].n);
+  for(i = 0; i < s->names_size; i++)
+    if((c = s->names[i].c))
+      fprintf(f, "channel %s %lld %lld %lld\n", c->name[0] ? c->name : "-",
+              __atomic_load_n(&c->out_lines, __ATOMIC_RELAXED), c->fifo_lines,
+              __atomic_load_n(&c->outsize, __ATOMIC_RELAXED));
+  write_latencies(f, st);
+  if(fclose(f) || rename(tmp, path))
+    perror("plom-ii: cannot write stats file"); }
+
+static void on_usr1(int sig) {
+// Signal handler: have run() write stats files now.
+  stats_wanted = 1; }
+
+static void on_quit(int sig) {
+// Signal handler: have run() write stats files, then exit (ending its wait
+// through quit_pipe[]); on a second signal (as if that got stuck), exit now.
+  if(quitting)
+    _exit(EXIT_FAILURE);
+  quitting = 1;
+  write(quit_pipe[1], "", 1); }
 
 static void run() {
-// Repeatedly check socket and fifo descriptors, handle input / output.
+// Repeatedly wait for sockets and fifo descriptors, handle input / output.
+  Server *s;
   Channel *c;
-  int r, maxfd;
-  fd_set rd;
-  struct timeval tv;
+  int i, r, timeout, t;
+  time_t now;
+  struct epoll_event ev[MAX_EVENTS];
   char ping_msg[512];
-  snprintf(ping_msg, sizeof(ping_msg), "PING %s\r\n", host);
+  time_t stats_due = 0;
+  sigset_t unblocked;
+  sigprocmask(SIG_BLOCK, NULL, &unblocked);
+  sigdelset(&unblocked, SIGUSR1);
   for(;;) {
 
-    // Put socket and channel fifo descriptors into fd_set "rd".
-    FD_ZERO(&rd);
-    maxfd = irc;
-    FD_SET(irc, &rd);
-    for(c = channels; c; c = c->next) {
-      if(maxfd < c->fd)
-        maxfd = c->fd;
-      FD_SET(c->fd, &rd); }
-
-    // Use select() to check file descriptors' read-access readiness. Exit on failure.
-    tv.tv_sec = 120;
-    tv.tv_usec = 0;
-    r = select(maxfd + 1, &rd, 0, 0, &tv);
-    if(r < 0) {
-      if(errno == EINTR)
-        continue;
-      perror("plom-ii: error on select()");
+    // Send queued lines (urgent ones, bulk ones as pacing allows), write out
+    // batched outfile appends; then wait for descriptors' readiness, or until
+    // more may be sent or stats / fdatasync()s are due. SIGUSR1 is taken only
+    // during the wait, so it always ends it; SIGTERM and SIGINT end it through
+    // quit_pipe[]. Exit on failure.
+    timeout = PING_INTERVAL * 1000;
+    if((t = (stats_due - time(NULL)) * 1000) < timeout)
+      timeout = t > 0 ? t : 0;
+    if(sync_policy == SYNC_INTERVAL && (t = next_sync - now_ms()) < timeout)
+      timeout = t > 0 ? t : 0;
+    for(s = servers; s; s = s->next) {
+      if(s->fifos_stalled && s->welcomed && s->bulk.len < SENDQ_MAX / 2)
+        resume_fifos(s);
+      t = flush_sendq(s);
+      if(s->reconnect_at) {
+        if((t = s->reconnect_at - now_ms()) <= 0) {
+          s->reconnect_at = 0;
+          start_resolve(s); } }
+      else if(s->irc == -1 && s->next_addr < s->n_addrs) {
+        if((t = s->next_attempt - now_ms()) <= 0) {
+          start_attempt(s);
+          t = CONNECT_DELAY; } }
+      if(t >= 0 && t < timeout)
+        timeout = t; }
+    if(!writeq.size)
+      commit_outfiles();
+#ifdef IO_URING
+    if(net.fd != -1)
+      r = uring_wait(ev, timeout, &unblocked);
+    else
+#endif
+    r = epoll_pwait(epfd, ev, MAX_EVENTS, timeout, &unblocked);
+    if(r < 0 && errno != EINTR) {
+      perror("plom-ii: error on epoll_wait()");
       exit(EXIT_FAILURE); }
+    wakeups++;
 
-    // If select() time-outs, check for ping timeout, ping to socket. 
-    else if(r == 0) {
-      if(time(NULL) - last_response >= PING_TIMEOUT) {
-        print_out(NULL, "-!- ii shutting down: ping timeout");
-        exit(EXIT_FAILURE); }
-      write(irc, ping_msg, strlen(ping_msg));
-      continue; }
+    // Handle server outputs / channel inputs, reset last_response. Skip
+    // channels rm_channel()'d and connections dropped earlier in this batch
+    // (socket writability only matters to flush_sendq() above).
+    for(i = 0; i < r; i++)
+      switch(*(int *) ev[i].data.ptr) {
+        case WATCH_SERVER:
+          s = ev[i].data.ptr;
+          if(s->irc != -1 && !s->recv_armed &&
+             ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            handle_server_output(s);
+            s->last_response = time(NULL); }
+          break;
+        case WATCH_CHANNEL:
+          if((c = ev[i].data.ptr)->fd != -1)
+            handle_channels_input(c);
+          break;
+        case WATCH_ATTEMPT: handle_attempt(ev[i].data.ptr); break;
+        case WATCH_RESOLVER: handle_resolved(); break;
+        case WATCH_QUIT: break; }
+    if(writeq.size)
+      writeq_progress();
+    free_dead();
+
+    // Have outfiles fdatasync()ed every sync_interval seconds if SYNC_INTERVAL.
+    if(sync_policy == SYNC_INTERVAL && now_ms() >= next_sync) {
+      next_sync = now_ms() + sync_interval * 1000LL;
+      if(writeq.size)
+        writeq_put(NULL, 0, REC_SYNC, NULL, 0);
+      else if(any_unsynced)
+        sync_outfiles(); }
+
+    // After long server silence, check for ping timeout (then reconnect), ping
+    // to socket.
+    now = time(NULL);
+    for(s = servers; s; s = s->next) {
+      if(s->irc == -1)
+        continue;
+      if(now - s->last_response >= PING_TIMEOUT) {
+        drop_connection(s, "ping timeout");
+        continue; }
+      if(now - s->last_response >= PING_INTERVAL && now - s->last_ping >= PING_INTERVAL) {
+        snprintf(ping_msg, sizeof(ping_msg), "PING %s\r\n", s->host);
+        sendq_add(&s->urgent, ping_msg, strlen(ping_msg));
+        s->last_ping = now; } }
+
+    // Refresh stats files every STATS_INTERVAL seconds, or at once on SIGUSR1;
+    // a last time on SIGTERM / SIGINT, then exit.
+    if(stats_wanted || quitting || now >= stats_due) {
+      stats_wanted = 0;
+      stats_due = now + STATS_INTERVAL;
+      for(s = servers; s; s = s->next)
+        write_stats(s); }
+    if(quitting) {
+      if(writeq.size && sync_policy != SYNC_NONE)
+        writeq_put(NULL, 0, REC_SYNC, NULL, 0);
+      drain_writer();
+      if(!writeq.size) {
+        commit_outfiles();
+        if(sync_policy != SYNC_NONE)
+          sync_outfiles(); }
+#ifdef IO_URING
+      flush_appends();
+#endif
+      unlink_rings();
+      exit(EXIT_SUCCESS); } } }
+
+static void add_old_channels(Server *s) {
+// Add channels of s whose directories under its path still hold an "in" fifo
+// (left by an earlier run), to rejoin them once connected.
+  char in[PATH_MAX], name[PATH_MAX];
+  struct dirent *e;
+  struct stat st;
+  DIR *dir = opendir(s->path);
+  if(!dir)
+    return;
+  while((e = readdir(dir)))
+    if(e->d_name[0] != '.' &&
+       snprintf(in, sizeof(in), "%s/%s/in", s->path, e->d_name) < sizeof(in) &&
+       !stat(in, &st) && S_ISFIFO(st.st_mode)) {
+      snprintf(name, sizeof(name), "%s", e->d_name);
+      add_channel(s, name); }
+  closedir(dir); }
 
-    // Else, handle server output / channel inputs, reset last_response.
-    if(FD_ISSET(irc, &rd)) {
-      handle_server_output();
-      last_response = time(NULL); }
-    for(c = channels; c; c = c->next)
-      if(FD_ISSET(c->fd, &rd))
-        handle_channels_input(c); } }
+static Server *add_server(Server *defaults, char *host) {
+// Append new server for host, with settings of *defaults, to servers chain.
+  Server *s, **p;
+  if(!(s = malloc(sizeof(Server)))) {
+    perror("plom-ii: cannot allocate memory");
+    exit(EXIT_FAILURE); }
+  *s = *defaults;
+  s->host = host;
+  for(p = &servers; *p; p = &(*p)->next);
+  *p = s;
+  return s; }
 
 int main(int argc, char *argv[]) {
   int i;
-  unsigned short port = SERVER_PORT;
-  char *key = NULL, *fullname = NULL;
+  Server defaults = { WATCH_SERVER }, *s = &defaults;
   char prefix[_POSIX_PATH_MAX];
+  sigset_t handled;
+  struct sigaction quit;
 
   // Derive nickname and prefix from getpwuid(getuid()).
   struct passwd *spw = getpwuid(getuid());
   if(!spw) {
     fprintf(stderr,"plom-ii: getpwuid() failed\n");
     exit(EXIT_FAILURE); }
-  snprintf(nick, sizeof(nick), "%s", spw->pw_name);
+  snprintf(defaults.nick, sizeof(defaults.nick), "%s", spw->pw_name);
   snprintf(prefix, sizeof(prefix),"%s/irc", spw->pw_dir);
+  defaults.port = SERVER_PORT;
 
   // Print help screen if no command line argument, or "-h*".
   if (argc <= 1 || (argc == 2 && argv[1][0] == '-' && argv[1][1] == 'h'))
     usage();
 
-  // Fill variables according to command line arguments.
+  // Fill variables according to command line arguments. Each -s adds a server;
+  // -p, -n, -k, -f set up the latest one, or before any -s the defaults.
   for(i = 1; (i + 1 < argc) && (argv[i][0] == '-'); i++) {
     switch (argv[i][1]) {
       case 'i': snprintf(prefix,sizeof(prefix),"%s", argv[++i]); break;
-      case 's': host = argv[++i]; break;
-      case 'p': port = strtol(argv[++i], NULL, 10); break;
-      case 'n': snprintf(nick,sizeof(nick),"%s", argv[++i]); break;
-      case 'k': key = argv[++i]; break;
-      case 'f': fullname = argv[++i]; break;
+      case 's': s = add_server(&defaults, argv[++i]); break;
+      case 'p': s->port = strtol(argv[++i], NULL, 10); break;
+      case 'n': snprintf(s->nick,sizeof(s->nick),"%s", argv[++i]); break;
+      case 'k': s->key = argv[++i]; break;
+      case 'f': s->fullname = argv[++i]; break;
+      case 'b': pace_burst = strtol(argv[++i], NULL, 10); break;
+      case 'r': pace_ms = strtol(argv[++i], NULL, 10); break;
+      case 'm': ring_size = strtol(argv[++i], NULL, 10) * 1024; break;
+      case 'x': index_every = strtol(argv[++i], NULL, 10); break;
+      case 'w': writeq.size = strtol(argv[++i], NULL, 10) * 1024; break;
+      case 'y':
+        if(!strcmp(argv[++i], "none"))
+          sync_policy = SYNC_NONE;
+        else if(!strcmp(argv[i], "batch"))
+          sync_policy = SYNC_BATCH;
+        else if((sync_interval = strtol(argv[i], NULL, 10)) > 0)
+          sync_policy = SYNC_INTERVAL;
+        else
+          usage();
+        break;
+      case 'o':
+        if(!strcmp(argv[++i], "day"))
+          rotate_daily = 1;
+        else
+          rotate_size = strtoll(argv[i], NULL, 10) * 1024 * 1024;
+        break;
       default: usage(); break; } }
+  if(!servers)
+    add_server(&defaults, "irc.freenode.net");
+  for(i = 1; i < ring_size; i *= 2);
+  ring_size = ring_size ? i : 0;
+  for(i = WRITEQ_MIN; i < writeq.size; i *= 2);
+  writeq.size = writeq.size ? i : 0;
+  if((epfd = epoll_create1(0)) == -1 ||
+     pipe(resolved) == -1 || fcntl(resolved[0], F_SETFL, O_NONBLOCK) == -1 ||
+     epoll_ctl(epfd, EPOLL_CTL_ADD, resolved[0],
+               &(struct epoll_event) { EPOLLIN | EPOLLET, { &resolver_watch } }) == -1 ||
+     pipe(quit_pipe) == -1 || fcntl(quit_pipe[1], F_SETFL, O_NONBLOCK) == -1 ||
+     epoll_ctl(epfd, EPOLL_CTL_ADD, quit_pipe[0],
+               &(struct epoll_event) { EPOLLIN | EPOLLET, { &quit_watch } }) == -1) {
+    perror("plom-ii: cannot set up epoll");
+    exit(EXIT_FAILURE); }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGCHLD, SIG_IGN);
+  srand(time(NULL) ^ getpid());
+  started = time(NULL);
 
-  // Open socket to IRC server.
-  irc = tcpopen(port);
+  // Take SIGUSR1 (asking for stats files) only while run() waits for events;
+  // SIGTERM and SIGINT (asking to exit after writing them) anytime, without
+  // restarting waits they interrupt.
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &handled, NULL);
+  signal(SIGUSR1, on_usr1);
+  sigemptyset(&quit.sa_mask);
+  quit.sa_handler = on_quit;
+  quit.sa_flags = 0;
+  sigaction(SIGTERM, &quit, NULL);
+  sigaction(SIGINT, &quit, NULL);
 
-  // Set and, if necessary, create path: homedir prefix + "/" + host.
-  if(!snprintf(path, sizeof(path), "%s/%s", prefix, host)) {
-    fprintf(stderr, "%s", "plom-ii: path to irc directory too long\n");
-    exit(EXIT_FAILURE); }
-  create_dirtree(path);
+  for(s = servers; s; s = s->next) {
+
+    // Start looking up IRC server's addresses; run() connects to them.
+    s->irc = -1;
+    for(i = 0; i < MAX_ATTEMPTS; i++) {
+      s->attempts[i].watch = WATCH_ATTEMPT;
+      s->attempts[i].srv = s;
+      s->attempts[i].fd = -1; }
+    start_resolve(s);
 
-  // Open server master channel; write login data to socket; start loop handling input/output.
-  add_channel("");
-  login(key, fullname);
+    // Set and, if necessary, create path: homedir prefix + "/" + host.
+    if(snprintf(s->path, sizeof(s->path), "%s/%s", prefix, s->host) >= sizeof(s->path)) {
+      fprintf(stderr, "%s", "plom-ii: path to irc directory too long\n");
+      exit(EXIT_FAILURE); }
+    create_dirtree(s->path);
+
+    // Open server master channel and channels of an earlier run, to be joined
+    // once connected() and logged in.
+    s->tokens = pace_burst;
+    s->backoff = RECONNECT_MIN;
+    add_channel(s, "");
+    add_old_channels(s); }
+
+  // Start loop handling input/output, and thread writing outfiles if wanted.
+  if(writeq.size)
+    start_writer();
+#ifdef IO_URING
+  start_uring();
+#endif
   run();
   return 0; }